@@ -0,0 +1,762 @@
+/*** 基准测试：把cv.c整体编入，不接终端直接调用编辑器内部函数 ***/
+
+#define main cv_main
+#include "cv.c"
+#undef main
+
+/*----------------------define--------------------------*/
+
+#define BENCH_ROWS 60
+#define BENCH_COLS 200
+#define BENCH_LINES 100000
+#define BENCH_FRAMES 1000
+#define BENCH_RCACHE (1024 * 1024)
+#define SUITE_CHUNK 4096     //分批生成render和高亮，每批测完就丢掉，内存不随文件增长
+#define SUITE_EDITS 10000
+#define SUITE_FRAMES 200
+#define SUITE_STEPS 1000
+#define SUITE_MISSES 5
+
+/*----------------------工具函数--------------------------*/
+
+//当前时间，单位纳秒
+static double now_ns()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+//生成一个C语言语料文件，返回文件名
+static char *make_corpus(int lines)
+{
+    static char path[32];
+    strcpy(path, "/tmp/cv_bench_XXXXXX.c");
+    int fd = mkstemps(path, 2);
+    if (fd == -1)
+    {
+        perror("mkstemps");
+        exit(1);
+    }
+    FILE *fp = fdopen(fd, "w");
+    for (int i = 0; i < lines; i++)
+    {
+        switch (i % 4)
+        {
+            case 0:
+                fprintf(fp, "/* block %d */\n", i);
+                break;
+            case 1:
+                fprintf(fp, "static int value_%d = %d; // counter\n", i, i * 7);
+                break;
+            case 2:
+                fprintf(fp, "\tif (value_%d > 0) return \"text %d\";\n", i - 1, i);
+                break;
+            default:
+                fprintf(fp, "    for (unsigned int j = 0; j < %d; j++) total += j;\n", i);
+                break;
+        }
+    }
+    fclose(fp);
+    return path;
+}
+
+//当前的常驻内存，单位字节
+static long rss_bytes()
+{
+    long pages = 0;
+    long resident = 0;
+    FILE *fp = fopen("/proc/self/statm", "r");
+    if (fp)
+    {
+        if (fscanf(fp, "%ld %ld", &pages, &resident) != 2)
+        {
+            resident = 0;
+        }
+        fclose(fp);
+    }
+    return resident * sysconf(_SC_PAGESIZE);
+}
+
+//init()要取终端大小，没有终端时直接退出；这里照init()设好编辑器用到的状态，屏幕固定为BENCH_ROWS行BENCH_COLS列
+static void bench_init()
+{
+    G.hl_epoch = 1;
+    pthread_mutex_init(&G.lock, NULL);
+    pthread_cond_init(&G.work_cond, NULL);
+    G.wake[0] = G.wake[1] = -1;
+    G.match.row = -1;
+    G.undo.limit = UNDO_LIMIT;
+    undo_clear();
+    G.rcache.limit = RENDER_CACHE_LIMIT;
+    G.swap.fd = -1;
+    G.swap.last = -1;
+    G.swap.head = 1;
+    pthread_mutex_init(&G.swap.lock, NULL);
+    pthread_mutex_init(&G.swap.io, NULL);
+    pthread_cond_init(&G.swap.cond, NULL);
+    G.job.fd = -1;
+    G.screenrows = BENCH_ROWS - 2;
+    G.screencols = BENCH_COLS;
+}
+
+/*----------------------行内存--------------------------*/
+
+//每行占用的常驻内存：刚打开时只有字符；限制render缓存从头翻到尾，只留最近显示的；不限制时全部显示过一遍后每行都有render和高亮
+static void bench_memory(long before)
+{
+    long opened = rss_bytes();
+    G.rcache.limit = BENCH_RCACHE;
+    for (G.rowoff = 0; G.rowoff < G.numrows; G.rowoff += G.screenrows)
+    {
+        G.cy = G.rowoff;
+        G.frame.len = 0;
+        compose_frame(&G.frame);
+    }
+    long paged = rss_bytes();
+    long cached = G.rcache.bytes;
+    G.rcache.limit = RENDER_CACHE_LIMIT;
+    for (int i = 0; i < G.numrows; i++)
+    {
+        row_render(i);
+    }
+    long shown = rss_bytes();
+    G.rowoff = 0;
+    G.cy = 10;
+    printf("rss after open:            %8.1f bytes/line\n", (double)(opened - before) / G.numrows);
+    printf("rss after paging, capped:  %8.1f bytes/line %8ld bytes cached\n", (double)(paged - before) / G.numrows, cached);
+    printf("rss after showing all:     %8.1f bytes/line %8ld bytes cached\n", (double)(shown - before) / G.numrows, G.rcache.bytes);
+}
+
+/*----------------------帧输出--------------------------*/
+
+//画BENCH_FRAMES帧：full为1时每帧整屏重画，否则每帧输入一个字符后增量重画；
+//reuse为1时写进跨帧复用的G.frame，否则每帧新建缓冲区
+static void bench_frames(const char *what, int full, int reuse)
+{
+    long bytes = 0;
+    long allocs = 0;
+    G.frame.allocs = 0;
+    double t = now_ns();
+    for (int i = 0; i < BENCH_FRAMES; i++)
+    {
+        if (full)
+        {
+            G.scr.valid = 0;
+        }
+        else
+        {
+            editor_insert_char('a' + i % 26);
+        }
+        if (reuse)
+        {
+            G.frame.len = 0;
+            compose_frame(&G.frame);
+            bytes += G.frame.len;
+        }
+        else
+        {
+            struct buffer ab = BUF_INIT;
+            compose_frame(&ab);
+            bytes += ab.len;
+            allocs += ab.allocs;
+            buf_free(&ab);
+        }
+    }
+    t = now_ns() - t;
+    allocs += reuse ? G.frame.allocs : 0;
+    printf("%-28s %8.0f bytes/frame %6.2f allocs/frame %8.0f ns/frame\n", what,
+           (double)bytes / BENCH_FRAMES, (double)allocs / BENCH_FRAMES, t / BENCH_FRAMES);
+}
+
+//整屏重画与增量重画每帧输出的字节数，以及写进每帧新建的缓冲区与跨帧复用的缓冲区时的扩容次数
+static void bench_frame()
+{
+    bench_frames("full redraw, fresh buffer:", 1, 0);
+    bench_frames("full redraw, reused buffer:", 1, 1);
+    bench_frames("typing, fresh buffer:", 0, 0);
+    bench_frames("typing, reused buffer:", 0, 1);
+}
+
+/*----------------------关键词查找--------------------------*/
+
+//改用散列表之前的查找方式：逐个关键词strlen再比较，作为对照
+static int keyword_linear(char **keywords, const char *s, long len)
+{
+    for (int j = 0; keywords[j]; j++)
+    {
+        int klen = strlen(keywords[j]);
+        int kw2 = keywords[j][klen - 1] == '|';
+        if (kw2)
+        {
+            klen--;
+        }
+        if (klen <= len && !memcmp(s, keywords[j], klen) && (klen == len || is_separator(s[klen])))
+        {
+            return kw2 ? HL_KEYWORD2 : HL_KEYWORD1;
+        }
+    }
+    return 0;
+}
+
+//在语料每个单词开头做一次关键词分类，比较线性查找与完美散列，再测整行语法分析的吞吐
+static void bench_keywords()
+{
+    long tokens = 0;
+    long bytes = 0;
+    long hits[2] = {0, 0};
+    double t_linear = 0;
+    double t_hash = 0;
+
+    for (int pass = 0; pass < 2; pass++)
+    {
+        double t = now_ns();
+        for (int i = 0; i < G.numrows; i++)
+        {
+            erow *row = row_at(i);
+            int prev_sep = 1;
+            for (long j = 0; j < row->size; j++)
+            {
+                if (prev_sep)
+                {
+                    int klen;
+                    int type = pass ? keyword_lookup(&C_HL_kw, &row->chars[j], row->size - j, &klen)
+                                    : keyword_linear(C_HL_keywords, &row->chars[j], row->size - j);
+                    hits[pass] += (type != 0);
+                    tokens += !pass;
+                }
+                prev_sep = is_separator(row->chars[j]);
+            }
+            bytes += pass ? 0 : row->size + 1;
+        }
+        t = now_ns() - t;
+        if (pass)
+        {
+            t_hash = t;
+        }
+        else
+        {
+            t_linear = t;
+        }
+    }
+    printf("keyword lookup, linear:    %8.2f ns/token (%ld tokens, %ld keywords)\n", t_linear / tokens, tokens, hits[0]);
+    printf("keyword lookup, hashed:    %8.2f ns/token (%ld tokens, %ld keywords)\n", t_hash / tokens, tokens, hits[1]);
+
+    struct hl_out out = {NULL, 0, 0, 0};
+    long spans = 0;
+    double t = now_ns();
+    for (int i = 0; i < G.numrows; i++)
+    {
+        erow *row = row_at(i);
+        out.n = 0;
+        out.end = 0;
+        syntax_scan(row->chars, row->size, 0, &out);
+        spans += out.n;
+    }
+    t = now_ns() - t;
+    printf("syntax_scan:               %8.2f ns/byte\n", t / bytes);
+    printf("highlight spans:           %8.2f bytes/line (%.2f spans/line, %.2f bytes/line one per byte)\n",
+           (double)spans * sizeof(struct hl_span) / G.numrows, (double)spans / G.numrows, (double)bytes / G.numrows);
+    free(out.spans);
+}
+
+/*----------------------行渲染--------------------------*/
+
+#define BENCH_LINE_LEN (100 * 1024)
+
+//对一行长数据生成render，比较逐字节扫描与运行时选出的向量化扫描
+static void bench_render()
+{
+    static const char *kinds[] = {"plain", "tabs"};
+    char *line = malloc(BENCH_LINE_LEN);
+    for (int kind = 0; kind < 2; kind++)
+    {
+        for (int i = 0; i < BENCH_LINE_LEN; i++)
+        {
+            line[i] = (kind && i % 64 == 63) ? '\t' : (i % 10 == 9) ? ',' : '0' + i % 10;
+        }
+        for (int impl = 0; impl < 2; impl++)
+        {
+            erow row;
+            row_init(&row, line, BENCH_LINE_LEN, 1);
+            find_special_impl = impl ? find_special_select : find_special_scalar;
+            double t = now_ns();
+            for (int i = 0; i < 1000; i++)
+            {
+                row_update_render(&row, 0);
+            }
+            t = now_ns() - t;
+            printf("render 100KB line, %-5s %s: %8.3f ns/byte\n", kinds[kind],
+                   impl ? "vector" : "scalar", t / 1000 / BENCH_LINE_LEN);
+            if (impl)
+            {
+                long sum = 0;
+                t = now_ns();
+                for (int i = 0; i < 100000; i++)
+                {
+                    sum += rx_to_cx(&row, cx_to_rx(&row, BENCH_LINE_LEN - i % 100));
+                }
+                t = now_ns() - t;
+                printf("cx_to_rx + rx_to_cx at line end:  %8.1f ns (%ld)\n", t / 100000, sum & 1);
+            }
+            free_row(&row);
+        }
+    }
+    free(line);
+}
+
+/*----------------------查找--------------------------*/
+
+//用同一套行扫描比较字面查找与正则表达式查找的吞吐
+static void bench_search()
+{
+    static const struct
+    {
+        const char *pattern;
+        int regex;
+    } cases[] = {
+        {"total += j", 0},
+        {"total \\+= j", 1},
+        {"value_[0-9]+ > 0", 1},
+        {"^\\s+for \\(.*; j\\+\\+\\)", 1},
+        {"(return|break) \"", 1},
+    };
+    for (unsigned int c = 0; c < sizeof(cases) / sizeof(cases[0]); c++)
+    {
+        struct matcher *m = matcher_new(cases[c].pattern, cases[c].regex);
+        long bytes = 0;
+        long n = 0;
+        double t = now_ns();
+        for (int i = 0; i < G.numrows; i++)
+        {
+            erow *row = row_at(i);
+            n += row_count(row, m);
+            bytes += row->size + 1;
+        }
+        t = now_ns() - t;
+        printf("count %-5s %-28s %6.2f ns/byte (%ld matches)\n", cases[c].regex ? "regex" : "text",
+               cases[c].pattern, t / bytes, n);
+        matcher_free(m);
+    }
+
+    //找不到匹配时要查遍整个文件，比较不同线程数下一次查找的耗时
+    static const int threads[] = {1, 2, 4, 8};
+    for (unsigned int k = 0; k < sizeof(threads) / sizeof(threads[0]); k++)
+    {
+        G.search.nthreads = threads[k];
+        double t = now_ns();
+        for (int i = 0; i < 20; i++)
+        {
+            search_reset();
+            search_next("no such text", G.numrows / 2, i % 2 ? -1 : 1);
+        }
+        t = now_ns() - t;
+        printf("search miss, %d thread%s:     %8.0f us\n", threads[k], threads[k] > 1 ? "s" : " ", t / 20 / 1000);
+    }
+    G.search.nthreads = 0;
+    search_reset();
+}
+
+/*----------------------超大文件--------------------------*/
+
+#define HUGE_LINE_LEN ((1L << 31) + (64L << 20)) //超过2^31字节的单行
+#define HUGE_REST_LINES 550000                   //其后的普通行，让整个文件超过4GB
+#define HUGE_REST_LEN 4000
+#define HUGE_MARK "HUGE_END"
+
+static char huge_path[] = "/tmp/cv_huge_XXXXXX";
+
+//检查一项结果，不符合就报错退出
+static void huge_check(int ok, const char *what)
+{
+    printf("%-44s %s\n", what, ok ? "ok" : "FAILED");
+    if (!ok)
+    {
+        unlink(huge_path);
+        exit(1);
+    }
+}
+
+//生成一个超过4GB、含一行超过2GB长行的文件，打开、定位、查找、在长行末尾插入字符再保存，
+//检查所有字节偏移都没有在32位处截断。需要约9GB磁盘空间和3GB内存，只在./bench huge时运行
+static void bench_huge()
+{
+    char *path = huge_path;
+    int fd = mkstemp(path);
+    if (fd == -1)
+    {
+        perror("mkstemp");
+        exit(1);
+    }
+    double t = now_ns();
+    char *buf = malloc(HUGE_REST_LEN + 1);
+    FILE *fp = fdopen(fd, "w");
+    //第0行是短行，第1行是长行：开头和末尾附近各有一个Tab，最后是查找用的标记
+    fprintf(fp, "first line\n\t");
+    memset(buf, 'x', HUGE_REST_LEN);
+    long left = HUGE_LINE_LEN - 1 - (long)strlen(HUGE_MARK) - 1;
+    while (left > 0)
+    {
+        long n = left < HUGE_REST_LEN ? left : HUGE_REST_LEN;
+        fwrite(buf, 1, n, fp);
+        left -= n;
+    }
+    fprintf(fp, "\t%s\n", HUGE_MARK);
+    for (int i = 0; i < HUGE_REST_LINES; i++)
+    {
+        memset(buf, 'a' + i % 26, HUGE_REST_LEN);
+        buf[HUGE_REST_LEN] = '\n';
+        fwrite(buf, 1, HUGE_REST_LEN + 1, fp);
+    }
+    free(buf);
+    if (fclose(fp) != 0)
+    {
+        perror("write");
+        unlink(path);
+        exit(1);
+    }
+    struct stat st;
+    stat(path, &st);
+    long long size = st.st_size;
+    printf("generate %lld bytes:               %8.1f s\n", size, (now_ns() - t) / 1e9);
+    huge_check(size > (1LL << 32), "file is larger than 4GB");
+
+    bench_init();
+    t = now_ns();
+    editor_open(path);
+    printf("open:                                 %8.1f s\n", (now_ns() - t) / 1e9);
+    huge_check(G.numrows == HUGE_REST_LINES + 2, "row count");
+    erow *row = row_at(1);
+    huge_check(row->size == HUGE_LINE_LEN, "long line size is past 2^31");
+    huge_check(row_at(G.numrows - 1)->chars[HUGE_REST_LEN - 1] == 'a' + (HUGE_REST_LINES - 1) % 26,
+               "last row read back past 4GB");
+
+    //开头的Tab占TAB_STOP列，第二个Tab在2^31之后，展开到下一个Tab位置
+    long end = row->size;
+    long mark = (long)strlen(HUGE_MARK);
+    long rx_tab = end - mark - 1 + (TAB_STOP - 1);
+    long rx_end = (rx_tab / TAB_STOP + 1) * TAB_STOP + mark;
+    huge_check(cx_to_rx(row, end) == rx_end && row->rsize == rx_end, "cx_to_rx at the end of the long line");
+    huge_check(rx_to_cx(row, rx_end) == end && rx_to_cx(row, rx_tab + 1) == end - mark - 1,
+               "rx_to_cx at the end of the long line");
+    row_drop(row);
+
+    t = now_ns();
+    G.search.nthreads = 1;
+    int found = search_next(HUGE_MARK, 0, 1);
+    struct matcher *m = matcher_new(HUGE_MARK, 0);
+    long mlen;
+    long at = matcher_find(m, row->chars, row->size, 0, &mlen);
+    matcher_free(m);
+    printf("search to the end of the long line:   %8.1f s\n", (now_ns() - t) / 1e9);
+    huge_check(found == 1 && at == end - mark, "match offset is past 2^31");
+
+    G.cy = 1;
+    G.cx = end;
+    editor_insert_char('!');
+    row = row_at(1);
+    huge_check(row->size == end + 1 && row->chars[end] == '!', "insert at the end of the long line");
+
+    t = now_ns();
+    save();
+    printf("save:                                 %8.1f s\n", (now_ns() - t) / 1e9);
+    stat(path, &st);
+    char c = 0;
+    fd = open(path, O_RDONLY);
+    if (pread(fd, &c, 1, strlen("first line\n") + end) != 1)
+    {
+        c = 0;
+    }
+    close(fd);
+    huge_check(st.st_size == size + 1 && c == '!', "saved file has the inserted byte");
+    huge_check(fcntl(STDIN_FILENO, F_GETFD) != -1, "stdin is still open after save");
+
+    unlink(path);
+}
+
+/*----------------------回归检查--------------------------*/
+
+static int check_failed = 0;
+
+//检查一项结果，不符合时记下，全部检查完再以失败退出
+static void check(int ok, const char *what)
+{
+    printf("%-52s %s\n", what, ok ? "ok" : "FAILED");
+    if (!ok)
+    {
+        check_failed = 1;
+    }
+}
+
+//撤销日志正好写满时再输入一个字符：并入最后一条记录放不下，不能把这条记录也截掉后再往里写
+static void check_undo_limit()
+{
+    G.undo.limit = 1 << 20;
+    undo_clear();
+    editor_insert_row(0, "", 0);
+    undo_clear();
+
+    long n = G.undo.limit - (long)sizeof(struct undo_rec);
+    char *s = malloc(n);
+    memset(s, 'a', n);
+    undo_begin();
+    row_insert_string(0, 0, s, n);
+    free(s);
+    check(G.undo.len == G.undo.limit, "undo journal filled to the limit");
+    undo_begin();
+    row_insert_string(0, n, "x", 1);
+    check(G.undo.len <= G.undo.limit && G.undo.last >= 0, "typing into a full journal stays within the limit");
+    editor_undo();
+    erow *row = row_at(0);
+    check(row->size == n && row->chars[n - 1] == 'a', "undo removes only the typed character");
+
+    editor_del_row(0);
+    undo_clear();
+    G.undo.limit = UNDO_LIMIT;
+}
+
+//在行尾回车只记一条插入行的记录，不再跟一条空的删除
+static void check_enter_at_end()
+{
+    undo_clear();
+    editor_insert_row(0, "abc", 3);
+    undo_clear();
+    G.cy = 0;
+    G.cx = 3;
+    undo_begin();
+    insert_new_line();
+    int n = 0;
+    for (long off = 0; off < G.undo.len; off += undo_rec_size((struct undo_rec *)&G.undo.buf[off]))
+    {
+        n++;
+    }
+    check(n == 1 && ((struct undo_rec *)G.undo.buf)->type == UNDO_INSERT_ROWS, "enter at the end of a line journals one record");
+    editor_undo();
+    check(G.numrows == 1 && row_at(0)->size == 3, "undo of enter at the end of a line");
+
+    editor_del_row(0);
+    undo_clear();
+}
+
+//一行很长的a后面跟一个b，a+c|b只在最后匹配：逐个起点试锚定匹配时是平方级的，应当线性扫描
+static void check_regex_linear()
+{
+    static const long lens[] = {20000, 80000};
+    double ns[2];
+    for (int k = 0; k < 2; k++)
+    {
+        long n = lens[k];
+        char *s = malloc(n);
+        memset(s, 'a', n - 1);
+        s[n - 1] = 'b';
+        struct matcher *m = matcher_new("a+c|b", 1);
+        long mlen = 0;
+        double t = now_ns();
+        long at = matcher_find(m, s, n, 0, &mlen);
+        ns[k] = now_ns() - t;
+        matcher_free(m);
+        free(s);
+        check(at == n - 1 && mlen == 1, (k == 0) ? "a+c|b on 20k a's finds the final b" : "a+c|b on 80k a's finds the final b");
+    }
+    printf("a+c|b on 20k / 80k a's: %.2f / %.2f ms\n", ns[0] / 1e6, ns[1] / 1e6);
+    check(ns[1] < 100e6, "a+c|b on 80k a's takes under 100 ms");
+}
+
+//循环体超过32个NFA状态时，编译循环体会让状态数组扩容，循环的回边不能写到旧数组里
+static void check_regex_loop()
+{
+    static const struct
+    {
+        const char *pattern;
+        const char *s;
+        long at, len;
+    } cases[] = {
+        {"(abcdefghijklmnopqrstuvwxyz0123456789)*x", "-abcdefghijklmnopqrstuvwxyz0123456789abcdefghijklmnopqrstuvwxyz0123456789x", 1, 73},
+        {"(abcdefghijklmnopqrstuvwxyz|0123456789)+x", "--0123456789abcdefghijklmnopqrstuvwxyzx", 2, 37},
+    };
+    for (unsigned int c = 0; c < sizeof(cases) / sizeof(cases[0]); c++)
+    {
+        struct matcher *m = matcher_new(cases[c].pattern, 1);
+        long mlen = 0;
+        long at = matcher_find(m, cases[c].s, strlen(cases[c].s), 0, &mlen);
+        matcher_free(m);
+        check(at == cases[c].at && mlen == cases[c].len, (c == 0) ? "star over a 36-state body matches" : "plus over a 36-state body matches");
+    }
+}
+
+//./bench check：几项修过的问题的回归检查
+static int bench_check()
+{
+    bench_init();
+    check_undo_limit();
+    check_enter_at_end();
+    check_regex_linear();
+    check_regex_loop();
+    return check_failed;
+}
+
+/*----------------------JSON汇总--------------------------*/
+
+//在一种规模的语料上依次测打开、生成render、高亮、编辑、画屏、查找和保存，结果输出为一个JSON对象
+static void suite_corpus(int lines)
+{
+    char *path = make_corpus(lines);
+    struct stat st;
+    stat(path, &st);
+    bench_init();
+
+    long rss = rss_bytes();
+    double t = now_ns();
+    editor_open(path);
+    double open_ns = now_ns() - t;
+    long open_rss = rss_bytes() - rss;
+
+    //注释状态缓存在丢掉render之后还在，下一批接着往下算
+    double render_ns = 0;
+    double hl_ns = 0;
+    for (int i = 0; i < G.numrows; i += SUITE_CHUNK)
+    {
+        int end = (G.numrows - i < SUITE_CHUNK) ? G.numrows : i + SUITE_CHUNK;
+        t = now_ns();
+        for (int j = i; j < end; j++)
+        {
+            row_update_render(row_at(j), 0);
+        }
+        render_ns += now_ns() - t;
+        t = now_ns();
+        for (int j = i; j < end; j++)
+        {
+            update_syntax(j);
+        }
+        hl_ns += now_ns() - t;
+        for (int j = i; j < end; j++)
+        {
+            row_drop(row_at(j));
+        }
+    }
+
+    //从头到尾等距翻页，每帧都要生成新一屏的render和高亮
+    G.cy = G.cx = 0;
+    compose_frame(&G.frame);
+    long draw_bytes = 0;
+    t = now_ns();
+    for (int i = 0; i < SUITE_FRAMES; i++)
+    {
+        G.rowoff = (int)((long)i * G.numrows / SUITE_FRAMES);
+        G.frame.len = 0;
+        draw_rows(&G.frame);
+        draw_bytes += G.frame.len;
+    }
+    double draw_ns = now_ns() - t;
+
+    t = now_ns();
+    for (int i = 0; i < SUITE_EDITS; i++)
+    {
+        G.cy = (int)((long)i * G.numrows / SUITE_EDITS);
+        G.cx = 0;
+        editor_insert_char('a' + i % 26);
+    }
+    double edit_ns = now_ns() - t;
+
+    //找不到时查遍整个文件；每4行就有一处匹配时逐个往下跳
+    t = now_ns();
+    for (int i = 0; i < SUITE_MISSES; i++)
+    {
+        search_reset();
+        find_call_back("no such text", 't');
+    }
+    double miss_ns = now_ns() - t;
+    find_call_back("no such text", '\r');
+    find_call_back("total += j", 'j');
+    t = now_ns();
+    for (int i = 0; i < SUITE_STEPS; i++)
+    {
+        find_call_back("total += j", ARROW_DOWN);
+    }
+    double step_ns = now_ns() - t;
+    find_call_back("total += j", '\r');
+
+    t = now_ns();
+    save();
+    double save_ns = now_ns() - t;
+    unlink(path);
+
+    printf("    {\n");
+    printf("      \"lines\": %d,\n", lines);
+    printf("      \"bytes\": %lld,\n", (long long)st.st_size);
+    printf("      \"open_ns\": %.0f,\n", open_ns);
+    printf("      \"open_rss_bytes_per_line\": %.1f,\n", (double)open_rss / lines);
+    printf("      \"render_ns_per_byte\": %.3f,\n", render_ns / st.st_size);
+    printf("      \"highlight_ns_per_byte\": %.3f,\n", hl_ns / st.st_size);
+    printf("      \"draw_ns_per_frame\": %.0f,\n", draw_ns / SUITE_FRAMES);
+    printf("      \"draw_bytes_per_frame\": %.0f,\n", (double)draw_bytes / SUITE_FRAMES);
+    printf("      \"edit_ns_per_char\": %.0f,\n", edit_ns / SUITE_EDITS);
+    printf("      \"search_miss_ns\": %.0f,\n", miss_ns / SUITE_MISSES);
+    printf("      \"search_next_ns\": %.0f,\n", step_ns / SUITE_STEPS);
+    printf("      \"save_ns\": %.0f\n", save_ns);
+    printf("    }");
+}
+
+//./bench json [行数...]：默认在1万到1000万行的语料上各跑一遍，输出JSON便于比较不同版本；
+//每种规模在子进程中运行，编辑器状态和常驻内存互不影响
+static void bench_json(int argc, char **argv)
+{
+    static const int sizes[] = {10000, 100000, 1000000, 10000000};
+    int n = (argc > 0) ? argc : (int)(sizeof(sizes) / sizeof(sizes[0]));
+    printf("{\n  \"version\": \"%s\",\n  \"corpora\": [", VERSION);
+    for (int i = 0; i < n; i++)
+    {
+        int lines = (argc > 0) ? atoi(argv[i]) : sizes[i];
+        printf(i ? ",\n" : "\n");
+        fflush(stdout);
+        pid_t pid = fork();
+        if (pid == 0)
+        {
+            suite_corpus(lines);
+            fflush(stdout);
+            _exit(0);
+        }
+        int status = 0;
+        if (pid == -1 || waitpid(pid, &status, 0) == -1 || !WIFEXITED(status) || WEXITSTATUS(status) != 0)
+        {
+            fprintf(stderr, "bench json: %d lines failed\n", lines);
+            exit(1);
+        }
+    }
+    printf("\n  ]\n}\n");
+}
+
+int main(int argc, char **argv)
+{
+    if (argc > 1 && !strcmp(argv[1], "check"))
+    {
+        return bench_check();
+    }
+    if (argc > 1 && !strcmp(argv[1], "json"))
+    {
+        bench_json(argc - 2, argv + 2);
+        return 0;
+    }
+    if (argc > 1 && !strcmp(argv[1], "huge"))
+    {
+        bench_huge();
+        return 0;
+    }
+
+    char *path = make_corpus(BENCH_LINES);
+
+    bench_init();
+    long rss = rss_bytes();
+    editor_open(path);
+    G.cy = 10;
+    G.cx = 4;
+
+    bench_memory(rss);
+    bench_keywords();
+    bench_render();
+    bench_search();
+    bench_frame();
+
+    unlink(path);
+    return 0;
+}
@@ -10,12 +10,23 @@
 #include <errno.h>
 #include <string.h>
 #include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 #include <sys/types.h>
+#include <sys/uio.h>
+#include <sys/file.h>
+#include <sys/wait.h>
+#include <signal.h>
 #include <time.h>
 #include <fcntl.h>
 #include <stdarg.h>
 #include <unistd.h>                      //Linux/Unix系统调用库
 #include <termios.h>                     //Linux控制台库
+#include <pthread.h>
+#include <poll.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#endif
 
 /*----------------------define--------------------------*/
 
@@ -23,16 +34,88 @@
 #define CTRL_KEY(k) ((k) & 0x1f)
 #define TAB_STOP 4                       //Tab占4空格
 #define QUIT_TIMES 3                     //忽视警告退出时连按三次
-#define BUF_INIT {NULL, 0}
+#define LAZY_OPEN_SIZE (8 * 1024 * 1024) //超过该大小的文件映射打开，按需生成行数据
+#define LOAD_BLOCK (1024 * 1024)         //普通打开时每次读入的块大小
+#define ROW_INLINE 19                    //不超过这么多字节(含结尾的\0)的短行直接存在行结构里，行结构正好96字节
+#define BUF_INIT {NULL, 0, 0, 0}
+#define BUF_MIN 4096                     //缓冲区最小容量
+#define ATTR_INVERSE 0x80
+#define SCREEN_GAP 8                     //相隔不到这么多格的改动合并输出，省去光标移动
+#define HL_SYNC_ROWS 1000                //注释状态缓存落后不超过这么多行时当场计算高亮，否则交给后台线程
+#define WORK_SLICE_BYTES (32 * 1024)     //后台线程每持有一次锁最多分析的字节数
+#define COUNT_BLOCK 4096                 //后台统计匹配数时每块的行数
+#define SEARCH_CHUNK_ROWS 1024           //并行查找时每块的行数
+#define SEARCH_THREADS_MAX 16            //并行查找最多的线程数
+#define SAVE_IOV 1024                    //保存时每次writev最多提交的片段数
+#define SAVE_FSYNC 1                     //保存时先fsync再改名替换原文件，改为0则省去等待磁盘
+#define UNDO_LIMIT (16 * 1024 * 1024)    //撤销日志默认最多占用的字节数，超出时丢掉最早的几组修改
+#define RENDER_CACHE_LIMIT (64 * 1024 * 1024)  //各行render、Tab表和高亮段默认最多合计占用的字节数，超出时丢掉最久没显示的
+#define SWAP_FLUSH_MS 500                //交换文件的写入线程攒这么多毫秒的修改一起写
+#define SWAP_MAGIC "cvswap2\n"
+#define INPUT_RING 4096                  //输入环形缓冲区的字节数
+#define ESC_TIMEOUT 50                   //单独的ESC之后最多等这么多毫秒的后续字节
+#define JOB_OUTPUT_MAX (1024 * 1024)     //输出窗格最多保留的输出字节数，超出时丢掉较早的一半
+#define RE_DFA_MAX 2048                  //正则表达式每个方向最多缓存的DFA状态数，超出时清空重建
+#define RE_GROUP (-1)                    //左优先DFA状态里NFA状态组之间的分隔
+#define RE_MATCHED (-2)                  //左优先DFA状态开头的标记：已经有组匹配过，不再加入新的起点
 #define HL_HIGHLIGHT_NUMBERS (1<<0)
 #define HL_HIGHLIGHT_STRINGS (1<<1)
 #define HLDB_ENTRIES (sizeof(HLDB) / sizeof(HLDB[0]))
 
 /*----------------------提前声明函数原型------------------------*/
 
+struct erow;
 void set_status_message(const char *fmt, ...);
 void refresh_screen();
 char *editor_prompt(char *prompt, void (*callback)(char *, int));
+void update_row(int filerow, long from);
+void row_update_render(struct erow *row, long from);
+void update_syntax(int filerow);
+struct erow *row_render(int filerow);
+void rcache_trim();
+struct hl_span *row_spans(struct erow *row, long *n);
+void row_fix(struct erow *row);
+void row_init(struct erow *row, const char *chars, long size, int mapped);
+void hl_invalidate(int filerow);
+int hl_entry_state(int filerow);
+int hl_fresh(int filerow);
+long find_special(const char *s, long len);
+long cx_to_rx(struct erow *row, long cx);
+long rx_to_cx(struct erow *row, long rx);
+void search_reset();
+struct matcher;
+struct buffer;
+long row_count(struct erow *row, struct matcher *m);
+long matcher_find(struct matcher *m, const char *s, long len, long from, long *mlen);
+long match_index();
+int syntax_color(int hl);
+void editor_lock();
+void editor_unlock();
+int job_poll();
+void job_start(const char *name, const char *cmd);
+void job_kill();
+void pane_show(int show);
+void pane_scroll(int delta);
+int pane_rows();
+void draw_pane(struct buffer *ab);
+void request_redraw();
+void editor_insert_text(const char *s, long len);
+void undo_record(int type, int row, long col, const char *s, long len);
+void row_insert_string(int filerow, long at, const char *s, long len);
+void row_delete_string(int filerow, long at, long len);
+void undo_begin();
+void undo_mark_saved();
+void editor_undo();
+void editor_redo();
+static void undo_clear();
+void swap_record(int type, int row, long col, const char *s, long len);
+void swap_start();
+void swap_remove();
+void swap_saved();
+static void swap_attach();
+void editor_del_row(int at);
+void editor_insert_row(int at, char *s, size_t len);
+char *read_paste(int *len);
 
 /*----------------------枚举类型与结构体定义----------------------*/
 
@@ -46,7 +129,9 @@ enum function_key
     ARROW_DOWN,
     DEL_KEY,
     PAGE_UP,
-    PAGE_DOWN
+    PAGE_DOWN,
+    REFRESH_KEY,          //不是真实按键：后台线程有了新结果，需要重画
+    PASTE_KEY             //括号粘贴开始，粘贴的内容由read_paste读出
 };
 
 //不同类型对应不同高亮颜色
@@ -62,13 +147,55 @@ enum editor_highlight
     HL_MATCH
 };
 
+//一段同类高亮：一行的高亮由从行首起首尾相接的若干段组成，最后一段之后都是HL_NORMAL
+#define HL_SPAN_MAX 65535     //一段的最大长度，更长的同类字符拆成几段
+struct hl_span 
+{
+    unsigned short len;
+    unsigned char type;
+};
+
+//语法分析输出的高亮段，边分析边追加
+struct hl_out 
+{
+    struct hl_span *spans;
+    long n;
+    long cap;
+    long end;             //已输出到的位置
+};
+
+//行字符的存放位置
+enum row_store 
+{
+    ROW_MAPPED = 0,       //直接指向映射的文件，不属于本行
+    ROW_INL,              //短行存在行结构里
+    ROW_SLAB              //在本行slab的开头
+};
+
+
+//关键词散列表的一个槽位，word为NULL表示空槽
+struct keyword 
+{
+    const char *word;
+    int len;
+    int type;             //HL_KEYWORD1或HL_KEYWORD2
+};
+
+//编译时生成的关键词完美散列表，见kwgen.c
+struct keyword_table 
+{
+    const struct keyword *slots;
+    unsigned int mask;    //表长减一
+    unsigned int seed;
+    int minlen, maxlen;
+};
 
 //语法高亮结构体
 struct editor_syntax 
 {
     char *filetype;
     char **filematch;
-    char **keywords;
+    const struct keyword_table *keywords;
     char *singleline_comment_start;
     char *multiline_comment_start;
     char *multiline_comment_end;
@@ -78,30 +205,412 @@ struct editor_syntax
 //存储行文本
 typedef struct erow 
 {
-    int idx;
-    int size;
-    int rsize;
-    char *chars;          //字符
-    char *render;         //符号
-    unsigned char *hl;    //高亮标志
-    int hl_open_comment;  //注释高亮
+    long size;
+    long rsize;
+    char *chars;          //字符：短行在inl里，长行在slab开头，映射打开的行直接指向文件
+    char *render;         //符号：没有Tab时就是chars，否则在slab里
+    char *slab;           //本行唯一的一块堆内存，依次是[字符][Tab表][render][高亮段]，用不到的段不占空间
+    long cap;             //slab里字符段的容量，字符不在slab里时为0
+    long ntabs;           //Tab表：每个Tab的字符索引与展开后的结束符号索引，两两一组，随render生成
+    unsigned int gen;          //内容版本号，每次修改取一个新的全局编号
+    unsigned int hl_gen;       //hl按哪个内容版本生成
+    unsigned int hl_epoch;     //hl按哪一版语法规则生成
+    unsigned int state_epoch;  //hl_open_comment按哪一版语法规则算出，不等于G.hl_epoch表示需要重算
+    unsigned char store;  //字符存放在哪里：ROW_MAPPED、ROW_INL或ROW_SLAB
+    unsigned char ctrl;   //render中有控制字符，显示时需要反色替换
+    unsigned char hl_open_comment;  //行尾是否处于多行注释中
+    unsigned char hl_entry;         //生成hl时行首的注释状态
+    unsigned char has_hl; //slab里有高亮段，用row_spans取得
+    char inl[ROW_INLINE];
 } erow;
 
+//行树：计数B+树，按行号插入、删除、查找均为O(log n)
+#define ROW_LEAF_MAX 64
+#define ROW_NODE_MAX 32
+
+struct row_leaf 
+{
+    int n;
+    struct row_leaf *prev, *next;
+    unsigned int used;           //最近一次有行显示时的帧号
+    int cached;                  //在render缓存登记表中的位置，-1表示没有登记
+    erow rows[ROW_LEAF_MAX];
+};
+
+struct row_node 
+{
+    int n;
+    int count[ROW_NODE_MAX];     //每个子树的行数
+    void *child[ROW_NODE_MAX];
+};
+
+struct row_tree 
+{
+    void *root;
+    int height;                  //0表示根就是叶子
+    struct row_leaf *hint;       //最近访问的叶子，加速顺序访问
+    int hint_start;
+};
+
+//批量建树：行依次填满叶子，最后自底向上一次建出内部节点
+struct row_builder 
+{
+    struct row_leaf **leaves;
+    int nleaves;
+    int cap;                     //leaves数组容量，按倍数增长
+    int numrows;
+};
+
+//创建缓冲结构体
+struct buffer 
+{
+    char *b;
+    int len;
+    int cap;
+    int allocs;           //扩容次数
+};
+
+//正则表达式语法树节点与NFA状态的类型
+enum re_type 
+{
+    RE_N_SET,             //字符集合
+    RE_N_CAT,
+    RE_N_ALT,
+    RE_N_STAR,
+    RE_N_PLUS,
+    RE_N_QUEST,
+    RE_N_EMPTY,
+    RE_CHAR,              //读入集合中的字符后转到out
+    RE_SPLIT,             //不读字符，同时转到out和out1
+    RE_MATCH
+};
+
+struct re_node 
+{
+    int type;
+    int left, right;
+    unsigned char set[32];     //RE_N_SET的字符位图
+};
+
+struct re_parser 
+{
+    const char *p;
+    const char *end;      //模式去掉结尾'$'后的末尾
+    int eol;
+    struct re_node *nodes;
+    int n, cap;
+    int error;
+};
+
+struct re_state 
+{
+    int type;
+    int out, out1;
+    unsigned char set[32];
+};
+
+//NFA：状态数组与入口
+struct re_prog 
+{
+    struct re_state *st;
+    int n, cap;
+    int start;
+};
+
+//按需构造的DFA，每个状态是一组NFA状态
+//非锚定的DFA每读一个字符都从起始状态开始一个新的组，各组按起点从早到晚排列；
+//某组匹配后丢掉它之后的组，也不再开始新的组，一直走到死状态时最后的接受位置就是最左最长匹配的结尾
+struct re_dfa 
+{
+    struct re_prog *prog;
+    int unanchored;
+    int nstates;
+    int cap;              //已分配的状态数，状态增加时转移表跟着扩大
+    int start;
+    int *next;            //转移表，每个状态256项，-1表示还没算过
+    int *set_start;       //各状态的NFA状态集合在pool中的位置与长度，长度为0是死状态
+    int *set_len;
+    unsigned char *accept;
+    int *pool;
+    int pool_len, pool_cap;
+    int *hash;            //NFA状态集合到DFA状态的开放寻址散列
+    int hash_cap;
+    unsigned int *mark;   //求闭包时标记已加入的NFA状态
+    unsigned int mark_gen;
+    int *stack;
+    int *scratch;
+    int skip;             //停在起始状态时唯一能离开的字节，-1表示没有
+};
+
+//一段字面文本
+struct re_lit 
+{
+    char *s;
+    int len;
+};
+
+//分析语法树得到的字面文本信息
+struct re_info 
+{
+    struct re_lit prefix, suffix, must, str;
+    int exact;
+};
+
+struct regex 
+{
+    int bol, eol;         //以'^'开头、以'$'结尾
+    struct re_lit must;   //每个匹配都包含的字面文本，用来快速排除
+    struct re_prog prog;
+    struct re_prog rprog;      //反转的表达式
+    struct re_dfa search;      //非锚定，找最左最长匹配的结尾
+    struct re_dfa longest;     //锚定在起点，找最长的匹配
+    struct re_dfa reverse;     //锚定在结尾往回走，找最早的起点
+};
+
+//查找用的匹配器
+struct matcher 
+{
+    char *pattern;
+    long len;
+    struct regex *re;     //NULL表示按字面查找
+    int bad;              //正则表达式有语法错误，什么都不匹配
+};
+
+//一块搜索结果：第c块管第c*SEARCH_CHUNK_ROWS行起的SEARCH_CHUNK_ROWS行
+struct search_chunk 
+{
+    int *rows;            //块内匹配的行号，升序
+    int n;
+    int done;             //已查完；查找中途取消的块保持未查，下次用到时再查
+};
+
+//一级搜索结果：查询的前qlen个字符匹配到的行，按块分开，只查找到过的块
+struct search_level 
+{
+    int qlen;
+    struct search_chunk *chunks;  //NULL表示空查询，所有行都匹配
+    int nchunks;
+};
+
+//查找线程池：界面线程和辅助线程按离起点由近到远的顺序领块来查
+//某块找到匹配后不再领更远的块，正在查更远块的线程也中途放弃
+struct search_pool 
+{
+    pthread_t threads[SEARCH_THREADS_MAX];
+    unsigned int seen[SEARCH_THREADS_MAX];  //每个辅助线程最近处理过的任务编号
+    int nthreads;         //辅助线程数，不含界面线程
+    pthread_mutex_t lock;
+    pthread_cond_t start; //有新任务
+    pthread_cond_t done;  //辅助线程都已做完本次任务
+    unsigned int job;     //任务编号，变化表示有新任务
+    int helpers;          //本次任务用到的辅助线程数
+    int active;           //还没做完本次任务的辅助线程数
+    const char *query;    //本次任务：在base的结果里筛选query，填进lv
+    int regex;
+    struct search_level *lv;
+    struct search_level *base;
+    int *order;           //按离起点由近到远排好的块号
+    int norder;
+    int first_lo, first_hi;  //第一块里只有这个范围内的行算在前方
+    int next;             //下一个待领的位置
+    int found;            //前方有匹配的最近位置，更远的块不必再查
+};
+
+//搜索引擎：按查询长度递增保存各级结果，每一级的查询都是下一级的前缀
+//查询变长时只在上一级匹配到的行里筛选，退格时直接退回上一级
+struct search 
+{
+    char *query;          //最近一次的查询
+    struct matcher *m;    //按query建好的匹配器，界面线程专用
+    int regex;            //按正则表达式查找
+    struct search_level *levels;
+    int nlevels;
+    int cap;
+    int nthreads;         //并行查找的线程数(含界面线程)，0表示按CPU核数
+    struct search_pool *pool;  //查找线程池，第一次查找多块时创建
+};
+
+//搜索时的匹配计数：后台线程按块统计每COUNT_BLOCK行里的匹配数，查询变化或修改文本时从头再来
+struct match_count 
+{
+    char *query;          //正在搜索的查询，NULL表示不在搜索
+    struct matcher *m;
+    int regex;
+    int row;              //当前匹配所在的行，-1表示没有
+    long *blocks;         //各块的匹配数
+    int nblocks;          //已统计完的块数
+    int cap;
+    long total;           //已统计部分的匹配总数
+};
+
+//render缓存：render、Tab表和高亮段都可以由chars重新生成，合计超出上限时整叶丢掉最久没显示过的
+struct render_cache 
+{
+    long bytes;           //所有行的render、Tab表和高亮段合计占用的字节数
+    long limit;           //最多占用的字节数
+    unsigned int clock;   //帧号，每画一帧加一
+    struct row_leaf **leaves;  //有行显示过的叶子
+    int n;
+    int cap;
+};
+
+//撤销记录的类型
+enum undo_type 
+{
+    UNDO_INSERT,          //在row行col处插入了len个字符
+    UNDO_DELETE,          //从row行col处删除了len个字符
+    UNDO_INSERT_ROWS,     //从row行起插入了col行，内容依次是各行的长度与字符
+    UNDO_DELETE_ROWS      //在row行处先后删除了col行，内容同上
+};
+
+//撤销记录头，后面紧跟len字节内容
+struct undo_rec 
+{
+    unsigned char type;
+    unsigned char group;  //一组的第一条：一次按键的所有修改是一组，一起撤销
+    long prev;            //前一条记录的字节数，0表示没有
+    int row;
+    long col, len;
+    long cx;              //这组修改之前的光标，撤销后回到这里
+    int cy;
+    long rcx;             //撤销这组时的光标，重做后回到这里
+    int rcy;
+};
+
+//撤销日志：记录依次存放在一块连续内存里，pos之前的可以撤销，之后的是撤销过、可以重做的
+struct undo 
+{
+    char *buf;
+    long len;
+    long cap;
+    long pos;
+    long last;            //pos之前最后一条记录的位置，-1表示没有
+    long limit;           //最多占用的字节数
+    long gstart;          //当前这组第一条记录的位置
+    int group;            //下一条记录开始新的一组
+    long gcx;             //开始这组时的光标
+    int gcy;
+    int sealed;           //最后一条记录不再接受合并
+    int replaying;        //正在撤销或重做，修改不记录
+    int overflow;         //这组修改超出上限，不再记录
+    long saved;           //保存文件时pos的值，-1表示已回不到保存时的状态
+};
+
+//交换文件头：建立时文件的大小和修改时间，文件之后又被改过则不能重放
+struct swap_head 
+{
+    char magic[8];
+    long long size;
+    long long mtime;
+    long long mtime_ns;
+};
+
+//交换文件记录头，后面紧跟len字节内容，编码与撤销记录相同
+struct swap_rec 
+{
+    int type;
+    int row;
+    long col, len;
+};
+
+//交换文件：修改先追加到内存，由写入线程定时追加到文件
+struct swap 
+{
+    char *path;           //交换文件名，NULL表示不记录
+    int fd;               //-1表示还没有建立
+    char *buf;            //还没写入的记录
+    long len;
+    long cap;
+    long last;            //buf中最后一条记录的位置，-1表示没有
+    int head;             //下一条记录前要先写文件头，开始一个新的交换文件
+    int started;          //写入线程已启动
+    int replaying;        //正在重放，修改不记录
+    int failed;           //写入出错，不再记录
+    pthread_mutex_t lock; //保护待写入的记录
+    pthread_mutex_t io;   //写文件时持有，删除交换文件时等写完
+    pthread_cond_t cond;  //有了新记录
+};
+
+//输入环形缓冲：一次读入终端所有可读的字节，再从中逐个解码按键
+struct input_ring 
+{
+    unsigned char buf[INPUT_RING];
+    unsigned int head;    //下一个待解码的字节，只增不减，取模得下标
+    unsigned int tail;    //下一个写入的位置
+};
+
+//后台任务：编译或运行当前文件的子进程，输出经非阻塞管道读进输出窗格
+struct job 
+{
+    pid_t pid;            //子进程号，也是它的进程组号；0表示没有任务在运行
+    int fd;               //读子进程输出的管道，-1表示已读完
+    const char *name;     //任务名，显示在窗格标题上；NULL表示还没运行过任务
+    int status;           //子进程结束时waitpid得到的状态
+    int kills;            //已发过几次终止信号，第二次起直接SIGKILL
+    char *out;            //保留的输出
+    int len;
+    int cap;
+    int *lines;           //每行在out中的起点，最后一行可能还没有换行符
+    int nlines;
+    int lines_cap;
+    int visible;          //输出窗格已打开，占用正文下方的行
+    int rows;             //窗格占的行数，含标题行
+    int scroll;           //窗格底部离输出末尾的行数，0表示跟着新输出走
+};
+
+//影子帧缓冲：front是上一帧已输出到终端的内容，back是正在绘制的一帧
+//字符与属性分开存放，一段字符可以整段复制；属性低7位是前景色的SGR码(0为默认色)，ATTR_INVERSE表示反色
+struct screen 
+{
+    int rows, cols;
+    char *front_ch;
+    unsigned char *front_attr;
+    char *back_ch;
+    unsigned char *back_attr;
+    int valid;            //front与终端实际内容一致
+    int attr;             //终端当前的显示属性
+    int cx, cy;           //终端光标位置，-1表示未知
+    int hidden;           //本帧已隐藏光标
+};
+
 struct editor_config 
 {
-    int cx, cy;           //光标位置
-    int rx;               //符号索引
+    long cx;              //光标位置：字符索引
+    int cy;               //光标所在行
+    long rx;              //符号索引
     int rowoff;           //行偏移
-    int coloff;           //列偏移
+    long coloff;          //列偏移
     int screenrows;
     int screencols;
     int numrows;
-    erow *row;
+    struct row_tree rows; //行树
     int dirty;            //修改标志
     char *filename;
+    char *map;            //映射打开的文件内容
+    size_t map_len;
     char statusmsg[80];
     time_t statusmsg_time;
     struct editor_syntax *syntax;
+    unsigned int hl_epoch;     //语法规则版本，切换语法时递增
+    int hl_frontier;      //此行之前各行的注释状态都可信
+    int hl_dirty_rows;    //注释状态需要重算的行数
+    unsigned int gen;     //最近分配的行内容版本号
+    pthread_mutex_t lock; //保护编辑器状态：界面线程除等待输入外一直持有，后台高亮线程分片持有
+    pthread_cond_t work_cond;  //界面线程放下锁时通知后台线程
+    int threaded;         //后台线程已启动
+    int ui_waiting;       //界面线程正在等锁，后台线程应尽快让出
+    int redraw;           //后台线程的结果影响到屏幕，需要重画
+    int wake[2];          //自管道：信号处理和后台线程写入，叫醒等在poll里的界面线程
+    volatile sig_atomic_t winch;  //终端大小变了
+    struct input_ring input;
+    struct screen scr;
+    struct buffer frame;  //输出缓冲，跨帧保留容量
+    struct search search; //搜索结果缓存，修改文本时作废
+    struct match_count match;  //搜索时的匹配计数
+    struct job job;       //编译运行当前文件的后台任务
+    struct undo undo;     //撤销日志
+    struct swap swap;     //交换文件，意外退出后恢复没保存的修改
+    struct render_cache rcache;  //显示过的行的render缓存
     struct termios origin_termios;
 };
 
@@ -123,6 +632,7 @@ void warn(const char *s)
 //退出时禁用原始模式
 void disable_raw_mode() 
 {
+    write(STDOUT_FILENO, "\x1b[?2004l", 8);
     if (tcsetattr(STDIN_FILENO, TCSAFLUSH, &G.origin_termios) == -1)
     {
         warn("tcsetattr");
@@ -150,6 +660,8 @@ void enable_raw_mode()
     {
         warn("tcsetattr");
     }
+    //打开括号粘贴：粘贴的内容夹在ESC [200~与ESC [201~之间，整段插入
+    write(STDOUT_FILENO, "\x1b[?2004h", 8);
 }
 
 //得到光标位置
@@ -213,24 +725,26 @@ int window_size(int *rows, int *cols)
 /*---------------------------创建缓冲区-----------------------------*/
 
 
-//创建缓冲结构体
-struct buffer 
-{
-    char *b;
-    int len;
-};
-
-//添加缓冲区
+//添加缓冲区，容量按倍数增长
 void buf_append(struct buffer *ab, const char *s, int len) 
 {
-    char *new = realloc(ab->b, ab->len + len);
-
-    if (new == NULL)
+    if (ab->len + len > ab->cap)
     {
-        return;
+        int cap = ab->cap ? ab->cap : BUF_MIN;
+        while (cap < ab->len + len)
+        {
+            cap *= 2;
+        }
+        char *new = realloc(ab->b, cap);
+        if (new == NULL)
+        {
+            return;
+        }
+        ab->b = new;
+        ab->cap = cap;
+        ab->allocs++;
     }
-    memcpy(&new[ab->len], s, len);
-    ab->b = new;
+    memcpy(&ab->b[ab->len], s, len);
     ab->len += len;
 }
 
@@ -239,856 +753,4745 @@ void buf_free(struct buffer *ab)
 {
     free(ab->b);
 }
-/*----------------------------输入----------------------------------*/
 
-//等待一个按键并返回值，功能键特殊判断
-int read_key() 
+/*---------------------------行树-----------------------------*/
+
+//子树中的行数
+static int row_subtree_count(void *p, int h)
 {
-    int nread;
-    char c;
-    while ((nread = read(STDIN_FILENO, &c, 1)) != 1) 
+    if (h == 0)
     {
-        if (nread == -1 && errno != EAGAIN)
-        {
-            warn("read");
-        }
+        return ((struct row_leaf *)p)->n;
     }
-
-    if (c == '\x1b') 
+    struct row_node *node = p;
+    int total = 0;
+    for (int i = 0; i < node->n; i++)
     {
-        char seq[3];
+        total += node->count[i];
+    }
+    return total;
+}
 
-        if (read(STDIN_FILENO, &seq[0], 1) != 1)
-        {
-            return '\x1b';
-        }
-        if (read(STDIN_FILENO, &seq[1], 1) != 1)
-        {
-            return '\x1b';
-        }
+//叶子里的行挪动位置后，存在行结构里的短行改指新位置
+static void row_leaf_moved(struct row_leaf *leaf)
+{
+    for (int i = 0; i < leaf->n; i++)
+    {
+        row_fix(&leaf->rows[i]);
+    }
+}
 
-        if (seq[0] == '[') 
-        {
-            if (seq[1] >= '0' && seq[1] <= '9') 
-            {
-                if (read(STDIN_FILENO, &seq[2], 1) != 1)
-                {
-                    return '\x1b';
-                }
-                if (seq[2] == '~')
-                {
-                    switch (seq[1]) 
-                    {
-                        case '3': 
-                            return DEL_KEY;
-                        case '5': 
-                            return PAGE_UP;
-                        case '6': 
-                            return PAGE_DOWN;
-                    }
-                }
-            } 
-            else 
-            {
-                switch (seq[1]) 
-                {
-                    case 'A': 
-                        return ARROW_UP;
-                    case 'B': 
-                        return ARROW_DOWN;
-                    case 'C': 
-                        return ARROW_RIGHT;
-                    case 'D': 
-                        return ARROW_LEFT;
-                }
-            }
-        } 
-        return '\x1b';
-    } 
-    else 
+//记下叶子在第used帧有行显示，没登记过的加入render缓存登记表
+static void rcache_touch(struct row_leaf *leaf, unsigned int used)
+{
+    struct render_cache *c = &G.rcache;
+    leaf->used = used;
+    if (leaf->cached >= 0)
     {
-        return c;
+        return;
+    }
+    if (c->n == c->cap)
+    {
+        c->cap = c->cap ? c->cap * 2 : 64;
+        c->leaves = realloc(c->leaves, sizeof(struct row_leaf *) * c->cap);
     }
+    leaf->cached = c->n;
+    c->leaves[c->n++] = leaf;
 }
 
-//上下左右移动光标
-void move_cursor(int key) 
+//把叶子从render缓存登记表中去掉，最后一项补到它的位置
+static void rcache_forget(struct row_leaf *leaf)
 {
-    erow *row = (G.cy >= G.numrows) ? NULL : &G.row[G.cy];
+    struct render_cache *c = &G.rcache;
+    struct row_leaf *last = c->leaves[--c->n];
+    c->leaves[leaf->cached] = last;
+    last->cached = leaf->cached;
+    leaf->cached = -1;
+}
 
-    switch (key) 
+//在子树第at行处腾出一个空位，*slot指向该位置，子树分裂时返回新的右兄弟
+static void *row_node_insert(void *p, int h, int at, erow **slot)
+{
+    if (h == 0)
     {
-        case ARROW_LEFT:
-            if (G.cx != 0) 
-            {
-                G.cx--;
-            } 
-            else if (G.cy > 0) 
-            {
-                G.cy--;
-                G.cx = G.row[G.cy].size;
-            }
-            break;
-        case ARROW_RIGHT:
-            if (row && G.cx < row->size) 
-            {
-                G.cx++;
-            } 
-            else if (row && G.cx == row->size) 
+        struct row_leaf *leaf = p;
+        struct row_leaf *sib = NULL;
+        if (leaf->n == ROW_LEAF_MAX)
+        {
+            //在文件末尾追加时不对半分，顺序载入时叶子保持全满
+            int keep = (at == leaf->n && leaf->next == NULL) ? leaf->n : leaf->n / 2;
+            sib = malloc(sizeof(struct row_leaf));
+            sib->n = leaf->n - keep;
+            sib->cached = -1;
+            if (leaf->cached >= 0)
             {
-                G.cy++;
-                G.cx = 0;
+                rcache_touch(sib, leaf->used);
             }
-            break;
-        case ARROW_UP:
-            if (G.cy != 0) 
+            memcpy(sib->rows, &leaf->rows[keep], sizeof(erow) * sib->n);
+            row_leaf_moved(sib);
+            leaf->n = keep;
+            sib->prev = leaf;
+            sib->next = leaf->next;
+            if (leaf->next)
             {
-                G.cy--;
+                leaf->next->prev = sib;
             }
-            break;
-        case ARROW_DOWN:
-            if (G.cy < G.numrows) 
+            leaf->next = sib;
+            if (at > keep || keep == ROW_LEAF_MAX)
             {
-                G.cy++;
+                leaf = sib;
+                at -= keep;
             }
-            break;
+        }
+        memmove(&leaf->rows[at + 1], &leaf->rows[at], sizeof(erow) * (leaf->n - at));
+        leaf->n++;
+        row_leaf_moved(leaf);
+        *slot = &leaf->rows[at];
+        return sib;
     }
 
-    row = (G.cy >= G.numrows) ? NULL : &G.row[G.cy];
-    int rowlen = row ? row->size : 0;
-    if (G.cx > rowlen) 
+    struct row_node *node = p;
+    int i = 0;
+    while (i < node->n - 1 && at > node->count[i])
     {
-        G.cx = rowlen;
+        at -= node->count[i];
+        i++;
+    }
+    void *child_sib = row_node_insert(node->child[i], h - 1, at, slot);
+    node->count[i]++;
+    if (child_sib == NULL)
+    {
+        return NULL;
+    }
+
+    int sib_count = row_subtree_count(child_sib, h - 1);
+    node->count[i] -= sib_count;
+
+    struct row_node *sib = NULL;
+    struct row_node *dst = node;
+    int pos = i + 1;
+    if (node->n == ROW_NODE_MAX)
+    {
+        int keep = (pos == node->n) ? node->n : node->n / 2;
+        sib = malloc(sizeof(struct row_node));
+        sib->n = node->n - keep;
+        memcpy(sib->count, &node->count[keep], sizeof(int) * sib->n);
+        memcpy(sib->child, &node->child[keep], sizeof(void *) * sib->n);
+        node->n = keep;
+        if (pos > keep || keep == ROW_NODE_MAX)
+        {
+            dst = sib;
+            pos -= keep;
+        }
     }
+    memmove(&dst->count[pos + 1], &dst->count[pos], sizeof(int) * (dst->n - pos));
+    memmove(&dst->child[pos + 1], &dst->child[pos], sizeof(void *) * (dst->n - pos));
+    dst->count[pos] = sib_count;
+    dst->child[pos] = child_sib;
+    dst->n++;
+    return sib;
 }
 
-//处理输入内容以及各种功能键，输入Ctrl-q退出程序
-void process_key() 
+//把节点的第a+1个子树并入第a个子树
+static void row_node_merge(struct row_node *node, int h, int a)
 {
-    static int quit_times = QUIT_TIMES;
-        //read_key()函数读取字节到c中，
-    int c = read_key();
-
-    switch (c) 
+    if (h == 1)
     {
-        case '\r':
-            insert_new_line();
-            break;
-        //输入Ctrl-q退出程序并清屏
-        case CTRL_KEY('q'):
-            //有未保存退出时提醒按键三次
-            if (G.dirty && quit_times > 0) 
-            {
-                set_status_message("WARNING!!! File has unsaved changes. Press Ctrl-Q %d more times to quit.", quit_times);
-                quit_times--;
-                return;
-            }
-            write(STDOUT_FILENO, "\x1b[2J", 4);
-            write(STDOUT_FILENO, "\x1b[H", 3);
-            exit(0);
-            break;
-        case CTRL_KEY('s'):
-            save();
-            break;
-        case CTRL_KEY('p'):
+        struct row_leaf *left = node->child[a];
+        struct row_leaf *right = node->child[a + 1];
+        memcpy(&left->rows[left->n], right->rows, sizeof(erow) * right->n);
+        left->n += right->n;
+        row_leaf_moved(left);
+        if (right->cached >= 0)
         {
-            //先保存未保存的变化
-            save();
-            //运行python代码
-            char sh[80];
-    	    strcpy (sh,"gnome-terminal -- bash -c \"python3 ");
-    	    strcat (sh,G.filename);
-    	    strcat (sh, "; exec bash\"");
-            system(sh);
+            rcache_touch(left, (left->cached >= 0 && left->used > right->used) ? left->used : right->used);
+            rcache_forget(right);
         }
-            break;
-        case CTRL_KEY('r'):
+        left->next = right->next;
+        if (right->next)
         {
-            //先保存未保存的变化
-            save();
-            //运行c代码
-            char sh[80];
-    	    strcpy (sh,"gcc ");
-    	    strcat (sh,G.filename);
-            system(sh);
-            system("gnome-terminal -- bash -c \"./a.out; exec bash\"");
+            right->next->prev = left;
         }
-            break;
+        free(right);
+    }
+    else
+    {
+        struct row_node *left = node->child[a];
+        struct row_node *right = node->child[a + 1];
+        memcpy(&left->count[left->n], right->count, sizeof(int) * right->n);
+        memcpy(&left->child[left->n], right->child, sizeof(void *) * right->n);
+        left->n += right->n;
+        free(right);
+    }
+    node->count[a] += node->count[a + 1];
+    memmove(&node->count[a + 1], &node->count[a + 2], sizeof(int) * (node->n - a - 2));
+    memmove(&node->child[a + 1], &node->child[a + 2], sizeof(void *) * (node->n - a - 2));
+    node->n--;
+}
 
-        case CTRL_KEY('f'):
-            find();
-            break;
+//子树过小时尝试与相邻兄弟合并
+static void row_node_rebalance(struct row_node *node, int h, int i)
+{
+    int max = (h == 1) ? ROW_LEAF_MAX : ROW_NODE_MAX;
+    int size = (h == 1) ? ((struct row_leaf *)node->child[i])->n : ((struct row_node *)node->child[i])->n;
+    if (size >= max / 4 || node->n < 2)
+    {
+        return;
+    }
 
-        case BACKSPACE:
-        case CTRL_KEY('h'):
-        case DEL_KEY:
-            if (c == DEL_KEY)
+    int a = (i + 1 < node->n) ? i : i - 1;
+    int sa = (h == 1) ? ((struct row_leaf *)node->child[a])->n : ((struct row_node *)node->child[a])->n;
+    int sb = (h == 1) ? ((struct row_leaf *)node->child[a + 1])->n : ((struct row_node *)node->child[a + 1])->n;
+    if (sa + sb <= max)
+    {
+        row_node_merge(node, h, a);
+    }
+}
+
+//从子树中删除第at行
+static void row_node_delete(void *p, int h, int at)
+{
+    if (h == 0)
+    {
+        struct row_leaf *leaf = p;
+        memmove(&leaf->rows[at], &leaf->rows[at + 1], sizeof(erow) * (leaf->n - at - 1));
+        leaf->n--;
+        row_leaf_moved(leaf);
+        return;
+    }
+
+    struct row_node *node = p;
+    int i = 0;
+    while (at >= node->count[i])
+    {
+        at -= node->count[i];
+        i++;
+    }
+    row_node_delete(node->child[i], h - 1, at);
+    node->count[i]--;
+    row_node_rebalance(node, h, i);
+}
+
+//从根查找第at行所在的叶子和叶子第一行的行号，不动hint，可供其他线程只读遍历
+struct row_leaf *row_leaf_find(int at, int *start)
+{
+    void *p = G.rows.root;
+    *start = 0;
+    for (int h = G.rows.height; h > 0; h--)
+    {
+        struct row_node *node = p;
+        int i = 0;
+        while (at - *start >= node->count[i])
+        {
+            *start += node->count[i];
+            i++;
+        }
+        p = node->child[i];
+    }
+    return p;
+}
+
+//按行号查找行，顺序访问时直接命中缓存的叶子或其相邻叶子
+erow *row_at(int at)
+{
+    struct row_tree *t = &G.rows;
+    struct row_leaf *leaf = t->hint;
+
+    if (leaf)
+    {
+        if (at >= t->hint_start + leaf->n && leaf->next &&
+            at < t->hint_start + leaf->n + leaf->next->n)
+        {
+            t->hint_start += leaf->n;
+            t->hint = leaf = leaf->next;
+        }
+        else if (at < t->hint_start && leaf->prev && at >= t->hint_start - leaf->prev->n)
+        {
+            t->hint = leaf = leaf->prev;
+            t->hint_start -= leaf->n;
+        }
+        if (at >= t->hint_start && at < t->hint_start + leaf->n)
+        {
+            return &leaf->rows[at - t->hint_start];
+        }
+    }
+
+    int start;
+    t->hint = row_leaf_find(at, &start);
+    t->hint_start = start;
+    return &t->hint->rows[at - start];
+}
+
+//在第at行处插入一个未初始化的行并返回它
+erow *row_tree_insert(int at)
+{
+    struct row_tree *t = &G.rows;
+    erow *slot;
+
+    if (t->root == NULL)
+    {
+        struct row_leaf *leaf = malloc(sizeof(struct row_leaf));
+        leaf->n = 0;
+        leaf->cached = -1;
+        leaf->prev = leaf->next = NULL;
+        t->root = leaf;
+        t->height = 0;
+    }
+
+    void *sib = row_node_insert(t->root, t->height, at, &slot);
+    if (sib)
+    {
+        struct row_node *root = malloc(sizeof(struct row_node));
+        root->n = 2;
+        root->child[0] = t->root;
+        root->count[0] = row_subtree_count(t->root, t->height);
+        root->child[1] = sib;
+        root->count[1] = row_subtree_count(sib, t->height);
+        t->root = root;
+        t->height++;
+    }
+    t->hint = NULL;
+    return slot;
+}
+
+//在批量建树的末尾追加一个未初始化的行并返回它
+erow *row_builder_push(struct row_builder *b)
+{
+    struct row_leaf *leaf = b->nleaves ? b->leaves[b->nleaves - 1] : NULL;
+    if (leaf == NULL || leaf->n == ROW_LEAF_MAX)
+    {
+        if (b->nleaves == b->cap)
+        {
+            b->cap = b->cap ? b->cap * 2 : 64;
+            b->leaves = realloc(b->leaves, sizeof(struct row_leaf *) * b->cap);
+        }
+        struct row_leaf *next = malloc(sizeof(struct row_leaf));
+        next->n = 0;
+        next->cached = -1;
+        next->prev = leaf;
+        next->next = NULL;
+        if (leaf)
+        {
+            leaf->next = next;
+        }
+        b->leaves[b->nleaves++] = leaf = next;
+    }
+    b->numrows++;
+    return &leaf->rows[leaf->n++];
+}
+
+//用批量建出的叶子替换空的行树
+void row_builder_finish(struct row_builder *b)
+{
+    struct row_tree *t = &G.rows;
+    void **level = (void **)b->leaves;
+    int n = b->nleaves;
+    int h = 0;
+
+    if (n == 0)
+    {
+        free(b->leaves);
+        return;
+    }
+    while (n > 1)
+    {
+        int parents = (n + ROW_NODE_MAX - 1) / ROW_NODE_MAX;
+        for (int i = 0; i < parents; i++)
+        {
+            struct row_node *node = malloc(sizeof(struct row_node));
+            node->n = 0;
+            for (int j = i * ROW_NODE_MAX; j < n && node->n < ROW_NODE_MAX; j++)
             {
-                move_cursor(ARROW_RIGHT);
+                node->child[node->n] = level[j];
+                node->count[node->n] = row_subtree_count(level[j], h);
+                node->n++;
             }
-            editor_del_char();
+            level[i] = node;
+        }
+        n = parents;
+        h++;
+    }
+
+    t->root = level[0];
+    t->height = h;
+    t->hint = NULL;
+    G.numrows = b->numrows;
+    free(b->leaves);
+}
+
+//从行树中移除第at行，行内容需由调用者先释放
+void row_tree_delete(int at)
+{
+    struct row_tree *t = &G.rows;
+
+    row_node_delete(t->root, t->height, at);
+    while (t->height > 0 && ((struct row_node *)t->root)->n == 1)
+    {
+        struct row_node *old = t->root;
+        t->root = old->child[0];
+        t->height--;
+        free(old);
+    }
+    t->hint = NULL;
+}
+/*----------------------------输入----------------------------------*/
+
+//信号处理：只记下标志并写自管道，叫醒等在poll里的界面线程
+static void on_signal(int sig)
+{
+    int saved = errno;
+    if (sig == SIGWINCH)
+    {
+        G.winch = 1;
+    }
+    char c = 0;
+    if (write(G.wake[1], &c, 1) == -1)
+    {
+        //管道满了说明已经有待处理的唤醒
+    }
+    errno = saved;
+}
+
+//后台线程的结果影响到屏幕：标记需要重画，标记之前没有待处理的重画时才叫醒界面线程
+void request_redraw()
+{
+    if (!__atomic_exchange_n(&G.redraw, 1, __ATOMIC_ACQ_REL))
+    {
+        char c = 0;
+        if (write(G.wake[1], &c, 1) == -1)
+        {
+            //同上，管道满时不必再写
+        }
+    }
+}
+
+//建立自管道，终端大小变化和子进程结束都经它叫醒事件循环
+void events_init()
+{
+    if (pipe2(G.wake, O_NONBLOCK | O_CLOEXEC) == -1)
+    {
+        warn("pipe2");
+    }
+    struct sigaction sa;
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = on_signal;
+    sigemptyset(&sa.sa_mask);
+    sa.sa_flags = SA_RESTART;
+    sigaction(SIGWINCH, &sa, NULL);
+    sigaction(SIGCHLD, &sa, NULL);
+}
+
+//把终端已经到达的字节全部读进环形缓冲，不阻塞
+static void input_fill()
+{
+    struct input_ring *in = &G.input;
+    struct pollfd pfd = {STDIN_FILENO, POLLIN, 0};
+    while (in->tail - in->head < INPUT_RING && poll(&pfd, 1, 0) > 0)
+    {
+        unsigned int at = in->tail % INPUT_RING;
+        unsigned int room = INPUT_RING - (in->tail - in->head);
+        if (room > INPUT_RING - at)
+        {
+            room = INPUT_RING - at;
+        }
+        ssize_t n = read(STDIN_FILENO, &in->buf[at], room);
+        if (n == -1 && errno != EAGAIN && errno != EINTR)
+        {
+            warn("read");
+        }
+        if (n <= 0)
+        {
             break;
+        }
+        in->tail += n;
+    }
+}
 
-        case PAGE_UP:
-        case PAGE_DOWN:
+//从环形缓冲中解码一个按键，功能键特殊判断
+//转义序列还不完整时返回-1；final表示等不到后续字节了，不完整的序列整个当作ESC键
+static int input_decode(int final)
+{
+    struct input_ring *in = &G.input;
+    unsigned int n = in->tail - in->head;
+    if (n == 0)
+    {
+        return -1;
+    }
+    unsigned char c = in->buf[in->head % INPUT_RING];
+    if (c != '\x1b')
+    {
+        in->head++;
+        return c;
+    }
+    if (n >= 2 && in->buf[(in->head + 1) % INPUT_RING] != '[')
+    {
+        //Alt组合键等其他转义序列：连同下一个字节一起丢掉
+        in->head += 2;
+        return '\x1b';
+    }
+
+    //CSI序列：ESC [ 参数字节 结束字节
+    char param[16];
+    int plen = 0;
+    unsigned int i;
+    for (i = 2; i < n; i++)
+    {
+        unsigned char b = in->buf[(in->head + i) % INPUT_RING];
+        if (b >= 0x40 && b <= 0x7e)
+        {
+            break;
+        }
+        if (plen < (int)sizeof(param) - 1)
+        {
+            param[plen++] = b;
+        }
+    }
+    if (i >= n)
+    {
+        if (!final)
+        {
+            return -1;
+        }
+        in->head = in->tail;
+        return '\x1b';
+    }
+    param[plen] = '\0';
+    unsigned char end = in->buf[(in->head + i) % INPUT_RING];
+    in->head += i + 1;
+
+    if (end == '~')
+    {
+        if (!strcmp(param, "3"))
+        {
+            return DEL_KEY;
+        }
+        if (!strcmp(param, "5"))
+        {
+            return PAGE_UP;
+        }
+        if (!strcmp(param, "6"))
+        {
+            return PAGE_DOWN;
+        }
+        if (!strcmp(param, "200"))
+        {
+            return PASTE_KEY;
+        }
+        if (!strcmp(param, "201"))
+        {
+            //没有配对的粘贴结束标记，什么也不做
+            return REFRESH_KEY;
+        }
+    }
+    else if (plen == 0)
+    {
+        switch (end) 
+        {
+            case 'A': 
+                return ARROW_UP;
+            case 'B': 
+                return ARROW_DOWN;
+            case 'C': 
+                return ARROW_RIGHT;
+            case 'D': 
+                return ARROW_LEFT;
+        }
+    }
+    return '\x1b';
+}
+
+//还有完整的按键等着处理，调用者可以先不重画
+int key_pending()
+{
+    input_fill();
+    unsigned int head = G.input.head;
+    int key = input_decode(0);
+    G.input.head = head;
+    return key != -1;
+}
+
+//终端大小变化：重新取得窗口大小，输出窗格按新高度重新划分，下一帧整屏重画
+void editor_resize()
+{
+    struct winsize ws;
+    if (ioctl(STDOUT_FILENO, TIOCGWINSZ, &ws) == -1 || ws.ws_col == 0)
+    {
+        return;
+    }
+    int visible = G.job.visible;
+    pane_show(0);
+    G.screenrows = (ws.ws_row > 2) ? ws.ws_row - 2 : 1;
+    G.screencols = ws.ws_col;
+    pane_show(visible);
+    G.scr.valid = 0;
+}
+
+//在poll里等待终端输入、自管道和任务输出，等待时放下锁让后台线程工作
+//timeout为毫秒，-1表示一直等；状态栏消息到期时也醒来一次把它擦掉
+//返回1表示输入以外的事件需要重画，*timed_out表示等到超时也没有事件
+static int event_wait(int timeout, int *timed_out)
+{
+    struct pollfd fds[3];
+    int nfds = 0;
+    fds[nfds++] = (struct pollfd){STDIN_FILENO, POLLIN, 0};
+    fds[nfds++] = (struct pollfd){G.wake[0], POLLIN, 0};
+    if (G.job.fd != -1)
+    {
+        fds[nfds++] = (struct pollfd){G.job.fd, POLLIN, 0};
+    }
+
+    int msg = -1;
+    if (G.statusmsg[0])
+    {
+        struct timespec ts;
+        clock_gettime(CLOCK_REALTIME, &ts);
+        long left = (G.statusmsg_time + 5 - ts.tv_sec) * 1000 - ts.tv_nsec / 1000000;
+        if (left >= 0)
+        {
+            msg = left + 1;
+        }
+    }
+    int wait = (msg >= 0 && (timeout < 0 || msg < timeout)) ? msg : timeout;
+
+    editor_unlock();
+    int r = poll(fds, nfds, wait);
+    editor_lock();
+    if (r == -1 && errno != EINTR)
+    {
+        warn("poll");
+    }
+
+    *timed_out = (r == 0 && wait == timeout);
+    int redraw = (r == 0 && wait != timeout);
+    if (fds[1].revents & POLLIN)
+    {
+        char junk[64];
+        while (read(G.wake[0], junk, sizeof(junk)) > 0)
+        {
+        }
+    }
+    if (G.winch)
+    {
+        G.winch = 0;
+        editor_resize();
+        redraw = 1;
+    }
+    if (job_poll())
+    {
+        redraw = 1;
+    }
+    if (__atomic_exchange_n(&G.redraw, 0, __ATOMIC_ACQ_REL))
+    {
+        redraw = 1;
+    }
+    input_fill();
+    return redraw;
+}
+
+//等待一个按键并返回值；后台线程、任务输出或窗口变化需要重画时返回REFRESH_KEY
+//单独的ESC之后等ESC_TIMEOUT毫秒，没有后续字节才当作ESC键
+int read_key() 
+{
+    int final = 0;
+    while (1)
+    {
+        int key = input_decode(final);
+        if (key != -1)
+        {
+            return key;
+        }
+        int partial = (G.input.tail != G.input.head);
+        int timed_out;
+        int redraw = event_wait(partial ? ESC_TIMEOUT : -1, &timed_out);
+        if (timed_out && partial)
+        {
+            final = 1;
+        }
+        else if (redraw)
+        {
+            return REFRESH_KEY;
+        }
+    }
+}
+
+//读出括号粘贴的内容直到ESC [201~，期间不重画；换行统一成\n，返回的内容由调用者释放
+char *read_paste(int *len)
+{
+    static const char end[] = "\x1b[201~";
+    int endlen = sizeof(end) - 1;
+    struct buffer b = BUF_INIT;
+    struct input_ring *in = &G.input;
+    char *mark = NULL;
+    while (mark == NULL)
+    {
+        while (in->head != in->tail && mark == NULL)
+        {
+            unsigned int at = in->head % INPUT_RING;
+            unsigned int n = in->tail - in->head;
+            if (n > INPUT_RING - at)
+            {
+                n = INPUT_RING - at;
+            }
+            int from = (b.len > endlen) ? b.len - endlen : 0;
+            buf_append(&b, (char *)&in->buf[at], n);
+            in->head += n;
+            mark = memmem(&b.b[from], b.len - from, end, endlen);
+        }
+        if (mark == NULL)
+        {
+            int timed_out;
+            event_wait(-1, &timed_out);
+        }
+    }
+    //结束标记之后已读入的字节放回环形缓冲
+    int rest = b.len - (mark - b.b) - endlen;
+    in->head -= rest;
+    b.len = mark - b.b;
+
+    int j = 0;
+    for (int i = 0; i < b.len; i++)
+    {
+        if (b.b[i] == '\r')
+        {
+            b.b[j++] = '\n';
+            if (i + 1 < b.len && b.b[i + 1] == '\n')
+            {
+                i++;
+            }
+        }
+        else
+        {
+            b.b[j++] = b.b[i];
+        }
+    }
+    *len = j;
+    return b.b;
+}
+
+//上下左右移动光标
+void move_cursor(int key) 
+{
+    erow *row = (G.cy >= G.numrows) ? NULL : row_at(G.cy);
+
+    switch (key) 
+    {
+        case ARROW_LEFT:
+            if (G.cx != 0) 
+            {
+                G.cx--;
+            } 
+            else if (G.cy > 0) 
+            {
+                G.cy--;
+                G.cx = row_at(G.cy)->size;
+            }
+            break;
+        case ARROW_RIGHT:
+            if (row && G.cx < row->size) 
+            {
+                G.cx++;
+            } 
+            else if (row && G.cx == row->size) 
+            {
+                G.cy++;
+                G.cx = 0;
+            }
+            break;
+        case ARROW_UP:
+            if (G.cy != 0) 
+            {
+                G.cy--;
+            }
+            break;
+        case ARROW_DOWN:
+            if (G.cy < G.numrows) 
+            {
+                G.cy++;
+            }
+            break;
+    }
+
+    row = (G.cy >= G.numrows) ? NULL : row_at(G.cy);
+    long rowlen = row ? row->size : 0;
+    if (G.cx > rowlen) 
+    {
+        G.cx = rowlen;
+    }
+}
+
+//处理输入内容以及各种功能键，输入Ctrl-q退出程序
+void process_key() 
+{
+    static int quit_times = QUIT_TIMES;
+        //read_key()函数读取字节到c中，
+    int c = read_key();
+    if (c == REFRESH_KEY)
+    {
+        return;
+    }
+    undo_begin();
+
+    switch (c) 
+    {
+        case '\r':
+            insert_new_line();
+            break;
+        //输入Ctrl-q退出程序并清屏
+        case CTRL_KEY('q'):
+            //有未保存退出时提醒按键三次
+            if (G.dirty && quit_times > 0) 
+            {
+                set_status_message("WARNING!!! File has unsaved changes. Press Ctrl-Q %d more times to quit.", quit_times);
+                quit_times--;
+                return;
+            }
+            if (G.job.pid > 0)
+            {
+                kill(-G.job.pid, SIGKILL);
+            }
+            swap_remove();
+            write(STDOUT_FILENO, "\x1b[2J", 4);
+            write(STDOUT_FILENO, "\x1b[H", 3);
+            exit(0);
+            break;
+        case CTRL_KEY('s'):
+            save();
+            break;
+        case CTRL_KEY('p'):
+            //运行python代码，输出显示在输出窗格里
+            job_start("python3", "exec python3 \"$1\"");
+            break;
+        case CTRL_KEY('r'):
+            //编译并运行c代码
+            job_start("gcc", "gcc \"$1\" -o a.out && exec ./a.out");
+            break;
+        case CTRL_KEY('z'):
+            editor_undo();
+            break;
+        case CTRL_KEY('y'):
+            editor_redo();
+            break;
+        case CTRL_KEY('k'):
+            job_kill();
+            break;
+        case CTRL_KEY('o'):
+            pane_show(!G.job.visible);
+            break;
+        case CTRL_KEY('u'):
+        case CTRL_KEY('d'):
+            pane_scroll((c == CTRL_KEY('u') ? 1 : -1) * (G.job.rows / 2 > 1 ? G.job.rows / 2 : 1));
+            break;
+
+        case CTRL_KEY('f'):
+            find();
+            break;
+
+        case PASTE_KEY:
+        {
+            int len;
+            char *text = read_paste(&len);
+            editor_insert_text(text, len);
+            free(text);
+        }
+            break;
+
+        case BACKSPACE:
+        case CTRL_KEY('h'):
+        case DEL_KEY:
+            if (c == DEL_KEY)
+            {
+                move_cursor(ARROW_RIGHT);
+            }
+            editor_del_char();
+            break;
+
+        case PAGE_UP:
+        case PAGE_DOWN:
+        {
+            if (c == PAGE_UP) 
+            {
+                G.cy = G.rowoff;
+            } 
+            else if (c == PAGE_DOWN) 
+            {
+                G.cy = G.rowoff + G.screenrows - 1;
+                if (G.cy > G.numrows)
+                {
+                    G.cy = G.numrows;
+                }
+            }
+            int times = G.screenrows;
+            while (times--)
+            {
+                move_cursor(c == PAGE_UP ? ARROW_UP : ARROW_DOWN);
+            }
+        }
+            break;
+
+        case ARROW_UP:
+        case ARROW_DOWN:
+        case ARROW_LEFT:
+        case ARROW_RIGHT:
+            move_cursor(c);
+            break;
+
+        case CTRL_KEY('l'):
+        case '\x1b':
+            break;
+
+        default:
+            editor_insert_char(c);
+            break;
+    }
+    quit_times = QUIT_TIMES;
+}
+
+/*--------------------输出---------------------*/
+
+//翻卷
+void scroll() 
+{
+    G.rx = 0;
+    if (G.cy < G.numrows) 
+    {
+        G.rx = cx_to_rx(row_at(G.cy), G.cx);
+    }
+
+    if (G.cy < G.rowoff) 
+    {
+        G.rowoff = G.cy;
+    }
+    if (G.cy >= G.rowoff + G.screenrows) 
+    {
+        G.rowoff = G.cy - G.screenrows + 1;
+    }
+    if (G.rx < G.coloff) 
+    {
+        G.coloff = G.rx;
+    }
+    if (G.rx >= G.coloff + G.screencols) 
+    {
+        G.coloff = G.rx - G.screencols + 1;
+    }
+}
+
+
+//重新分配影子帧缓冲，下一帧整屏重画
+void screen_resize(int rows, int cols)
+{
+    struct screen *s = &G.scr;
+
+    free(s->front_ch);
+    free(s->front_attr);
+    free(s->back_ch);
+    free(s->back_attr);
+    s->rows = rows;
+    s->cols = cols;
+    s->front_ch = malloc(rows * cols);
+    s->front_attr = malloc(rows * cols);
+    s->back_ch = malloc(rows * cols);
+    s->back_attr = malloc(rows * cols);
+    s->valid = 0;
+}
+
+//把正在绘制的一帧中的第y行清成空白
+void screen_clear_line(int y)
+{
+    memset(&G.scr.back_ch[y * G.scr.cols], ' ', G.scr.cols);
+    memset(&G.scr.back_attr[y * G.scr.cols], 0, G.scr.cols);
+}
+
+//在第y行第x格开始写入一段同属性的字符，超出屏幕的部分丢弃，返回写完后的位置
+int cells_put(int y, int x, const char *s, int len, int attr)
+{
+    if (len > G.scr.cols - x)
+    {
+        len = G.scr.cols - x;
+    }
+    if (len <= 0)
+    {
+        return x;
+    }
+    memcpy(&G.scr.back_ch[y * G.scr.cols + x], s, len);
+    memset(&G.scr.back_attr[y * G.scr.cols + x], attr, len);
+    return x + len;
+}
+
+//切换终端的显示属性
+void screen_set_attr(struct buffer *ab, int attr)
+{
+    struct screen *s = &G.scr;
+    if (attr == s->attr)
+    {
+        return;
+    }
+
+    char buf[16];
+    int color = (attr & ~ATTR_INVERSE) ? (attr & ~ATTR_INVERSE) : 39;
+    int len;
+    if ((attr & ATTR_INVERSE) == (s->attr & ATTR_INVERSE))
+    {
+        len = snprintf(buf, sizeof(buf), "\x1b[%dm", color);
+    }
+    else
+    {
+        len = snprintf(buf, sizeof(buf), "\x1b[0;%s%dm", (attr & ATTR_INVERSE) ? "7;" : "", color);
+    }
+    buf_append(ab, buf, len);
+    s->attr = attr;
+}
+
+//移动终端光标，本帧第一次输出内容前先隐藏光标
+void screen_move(struct buffer *ab, int y, int x)
+{
+    struct screen *s = &G.scr;
+    if (!s->hidden)
+    {
+        buf_append(ab, "\x1b[?25l", 6);
+        s->hidden = 1;
+    }
+    if (s->cy == y && s->cx == x)
+    {
+        return;
+    }
+
+    char buf[32];
+    int len = snprintf(buf, sizeof(buf), "\x1b[%d;%dH", y + 1, x + 1);
+    buf_append(ab, buf, len);
+    s->cy = y;
+    s->cx = x;
+}
+
+//输出第y行第from到to-1格，属性相同的一段只切换一次属性并整段复制
+void screen_emit(struct buffer *ab, int y, int from, int to)
+{
+    char *ch = &G.scr.back_ch[y * G.scr.cols];
+    unsigned char *attr = &G.scr.back_attr[y * G.scr.cols];
+    while (from < to)
+    {
+        int end = from + 1;
+        while (end < to && attr[end] == attr[from])
+        {
+            end++;
+        }
+        screen_set_attr(ab, attr[from]);
+        buf_append(ab, &ch[from], end - from);
+        from = end;
+    }
+}
+
+//比较第y行与上一帧，只输出变化了的格子
+void screen_flush_line(struct buffer *ab, int y)
+{
+    struct screen *s = &G.scr;
+    int cols = s->cols;
+    char *bch = &s->back_ch[y * cols];
+    char *fch = &s->front_ch[y * cols];
+    unsigned char *battr = &s->back_attr[y * cols];
+    unsigned char *fattr = &s->front_attr[y * cols];
+    int x;
+
+    if (memcmp(bch, fch, cols) == 0 && memcmp(battr, fattr, cols) == 0)
+    {
+        return;
+    }
+
+    int tail = cols;
+    while (tail > 0 && bch[tail - 1] == ' ' && battr[tail - 1] == 0)
+    {
+        tail--;
+    }
+
+    //多字节字符在终端上的宽度与字节数不同，这样的行整行重画
+    int wide = 0;
+    for (x = 0; x < cols && !wide; x++)
+    {
+        wide = ((unsigned char)bch[x] >= 0x80 || (unsigned char)fch[x] >= 0x80);
+    }
+
+    if (wide)
+    {
+        screen_move(ab, y, 0);
+        screen_emit(ab, y, 0, tail);
+        s->cx = -1;
+    }
+    else
+    {
+        x = 0;
+        while (x < tail)
+        {
+            if (bch[x] == fch[x] && battr[x] == fattr[x])
+            {
+                x++;
+                continue;
+            }
+            int last = x;
+            for (int k = x + 1; k < tail && k - last <= SCREEN_GAP; k++)
+            {
+                if (bch[k] != fch[k] || battr[k] != fattr[k])
+                {
+                    last = k;
+                }
+            }
+            screen_move(ab, y, x);
+            screen_emit(ab, y, x, last + 1);
+            s->cx = (last + 1 < cols) ? last + 1 : -1;
+            x = last + 1;
+        }
+    }
+
+    //行尾变成空白时用一次清除到行尾代替逐格输出空格
+    for (x = tail; x < cols; x++)
+    {
+        if (wide || fch[x] != ' ' || fattr[x] != 0)
+        {
+            if (!wide)
+            {
+                screen_move(ab, y, tail);
+            }
+            screen_set_attr(ab, 0);
+            buf_append(ab, "\x1b[K", 3);
+            break;
+        }
+    }
+    memcpy(fch, bch, cols);
+    memcpy(fattr, battr, cols);
+}
+
+//在第y行屏幕上用匹配色覆盖本行所有可见的匹配，高亮段保持不变
+void draw_matches(int y, erow *row, int len)
+{
+    int color = syntax_color(HL_MATCH);
+    long cx = 0;
+    long mlen;
+    while (cx < row->size && (cx = matcher_find(G.match.m, row->chars, row->size, cx, &mlen)) >= 0)
+    {
+        long from = cx_to_rx(row, cx) - G.coloff;
+        long to = cx_to_rx(row, cx + mlen) - G.coloff;
+        if (from >= len)
+        {
+            break;
+        }
+        if (from < 0)
+        {
+            from = 0;
+        }
+        if (to > len)
+        {
+            to = len;
+        }
+        if (to > from)
+        {
+            cells_put(y, from, &row->render[G.coloff + from], to - from, color);
+        }
+        cx += mlen ? mlen : 1;
+    }
+}
+
+//像vim一样画波浪线,语法高亮，并显示版本信息
+void draw_rows(struct buffer *ab) 
+{
+    int y;
+    G.rcache.clock++;
+    for (y = 0; y < G.screenrows; y++) 
+    {
+        screen_clear_line(y);
+        int filerow = y + G.rowoff;
+        if (filerow >= G.numrows) 
+        {
+            //1/3处显示信息
+            if (G.numrows == 0 && y == G.screenrows / 3) 
+            {
+                char welcome[80];
+                int welcomelen = snprintf(welcome, sizeof(welcome),"CV editor -- version %s", VERSION);
+                if (welcomelen > G.screencols)
+                {
+                    welcomelen = G.screencols;
+                }
+                //居中显示
+                int padding = (G.screencols - welcomelen) / 2;
+                if (padding) 
+                {
+                    cells_put(y, 0, "~", 1, 0);
+                }
+                cells_put(y, padding, welcome, welcomelen, 0);
+            } 
+            else 
+            {
+                cells_put(y, 0, "~", 1, 0);
+            }
+        } 
+        else 
+        {
+            erow *row = row_render(filerow);
+            long visible = row->rsize - G.coloff;
+            int len = (visible < 0) ? 0 : (visible > G.screencols) ? G.screencols : visible;
+            char *c = &row->render[G.coloff];
+            long n;
+            struct hl_span *spans = row_spans(row, &n);
+            int j = 0;
+            long start = -G.coloff;
+            //每个高亮段与屏幕相交的部分整段写入，最后一段之后是普通文本
+            for (long k = 0; k < n && j < len; k++)
+            {
+                start += spans[k].len;
+                if (start > j)
+                {
+                    int end = (start < len) ? start : len;
+                    cells_put(y, j, &c[j], end - j, (spans[k].type == HL_NORMAL) ? 0 : syntax_color(spans[k].type));
+                    j = end;
+                }
+            }
+            if (j < len)
+            {
+                cells_put(y, j, &c[j], len - j, 0);
+            }
+            //搜索时屏幕上所有的匹配都高亮
+            if (G.match.query && G.match.query[0])
+            {
+                draw_matches(y, row, len);
+            }
+            //控制字符反色显示，render中已没有Tab，特殊字节就是控制字符
+            if (row->ctrl)
+            {
+                for (j = 0; (j += find_special(&c[j], len - j)) < len; j++) 
+                {
+                    char sym = (c[j] <= 26) ? '@' + c[j] : '?';
+                    cells_put(y, j, &sym, 1, ATTR_INVERSE);
+                }
+            }
+        }
+        screen_flush_line(ab, y);
+    }
+    rcache_trim();
+}
+
+
+
+//生成一帧的输出：只重画与上一帧不同的部分，并将光标移动到原先位置
+void compose_frame(struct buffer *ab) 
+{
+    scroll();
+
+    struct screen *s = &G.scr;
+    if (s->rows != G.screenrows + pane_rows() + 2 || s->cols != G.screencols)
+    {
+        screen_resize(G.screenrows + pane_rows() + 2, G.screencols);
+    }
+
+    s->hidden = 0;
+    if (!s->valid) 
+    {
+        //终端内容未知时清屏，影子帧缓冲随之清成空白
+        buf_append(ab, "\x1b[?25l\x1b[m\x1b[2J", 13);
+        memset(s->front_ch, ' ', s->rows * s->cols);
+        memset(s->front_attr, 0, s->rows * s->cols);
+        s->attr = 0;
+        s->cx = s->cy = -1;
+        s->hidden = 1;
+        s->valid = 1;
+    }
+
+    draw_rows(ab);
+    draw_status_bar(ab);
+    draw_pane(ab);
+    draw_message_bar(ab);
+
+    int cy = G.cy - G.rowoff;
+    int cx = G.rx - G.coloff;
+    if (s->cy != cy || s->cx != cx) 
+    {
+        char buf[32];
+        snprintf(buf, sizeof(buf), "\x1b[%d;%dH", cy + 1, cx + 1);
+        buf_append(ab, buf, strlen(buf));
+        s->cy = cy;
+        s->cx = cx;
+    }
+    if (s->hidden)
+    {
+        buf_append(ab, "\x1b[?25h", 6);
+    }
+}
+
+//刷新屏幕，输出缓冲跨帧复用，稳定后每帧不再分配内存
+void refresh_screen() 
+{
+    G.frame.len = 0;
+    compose_frame(&G.frame);
+    if (G.frame.len)
+    {
+        write(STDOUT_FILENO, G.frame.b, G.frame.len);
+    }
+}
+
+//绘制状态栏
+void draw_status_bar(struct buffer *ab) 
+{
+    screen_clear_line(G.screenrows);
+    char status[80], rstatus[80];
+    int len = snprintf(status, sizeof(status), "%.20s - %d lines %s",
+        G.filename ? G.filename : "[No Name]", G.numrows,
+        G.dirty ? "(modified)" : "");
+    char mstatus[48] = "";
+    if (G.match.m && G.match.m->bad)
+    {
+        snprintf(mstatus, sizeof(mstatus), "bad regex | ");
+    }
+    else if (G.match.query && G.match.query[0])
+    {
+        //总数还没统计完时标上'+'
+        long k = match_index();
+        int counting = G.match.nblocks * COUNT_BLOCK < G.numrows;
+        if (k > 0)
+        {
+            snprintf(mstatus, sizeof(mstatus), "%smatch %ld of %ld%s | ", G.match.regex ? "regex " : "",
+                     k, G.match.total, counting ? "+" : "");
+        }
+        else
+        {
+            snprintf(mstatus, sizeof(mstatus), "%smatch ? of %ld%s | ", G.match.regex ? "regex " : "",
+                     G.match.total, counting ? "+" : "");
+        }
+    }
+    int rlen = snprintf(rstatus, sizeof(rstatus), "%s%s | %d/%d", mstatus,
+        G.syntax ? G.syntax->filetype : "no ft", G.cy + 1, G.numrows);
+    if (len > G.screencols)
+    {
+        len = G.screencols;
+    }
+    memset(&G.scr.back_attr[G.screenrows * G.scr.cols], ATTR_INVERSE, G.scr.cols);
+    cells_put(G.screenrows, 0, status, len, ATTR_INVERSE);
+    if (G.screencols - len >= rlen)
+    {
+        cells_put(G.screenrows, G.screencols - rlen, rstatus, rlen, ATTR_INVERSE);
+    }
+    screen_flush_line(ab, G.screenrows);
+}
+
+//显示提示函数
+char *editor_prompt(char *prompt, void (*callback)(char *, int)) 
+{
+    size_t bufsize = 128;
+    char *buf = malloc(bufsize);
+
+    size_t buflen = 0;
+    buf[0] = '\0';
+
+    while (1) 
+    {
+        set_status_message(prompt, buf);
+        if (!key_pending())
+        {
+            refresh_screen();
+        }
+
+        int c = read_key();
+        if (c == REFRESH_KEY)
+        {
+            continue;
+        }
+        if (c == DEL_KEY || c == CTRL_KEY('h') || c == BACKSPACE) 
+        {
+            if (buflen != 0)
+            {
+                buf[--buflen] = '\0';
+            }
+        } 
+        else if (c == '\x1b') 
+        {
+            set_status_message("");
+            if (callback)
+            {
+                callback(buf, c);
+            }
+            free(buf);
+            return NULL;
+        } 
+        else if (c == '\r') 
+        {
+            if (buflen != 0) 
+            {
+                set_status_message("");
+                if (callback)
+                {
+                    callback(buf, c);
+                }
+                return buf;
+            }
+        } 
+        else if (c == PASTE_KEY)
+        {
+            //粘贴到提示里只取可见字符
+            int len;
+            char *text = read_paste(&len);
+            for (int i = 0; i < len; i++)
+            {
+                if (iscntrl((unsigned char)text[i]) || (unsigned char)text[i] >= 128)
+                {
+                    continue;
+                }
+                if (buflen == bufsize - 1) 
+                {
+                    bufsize *= 2;
+                    buf = realloc(buf, bufsize);
+                }
+                buf[buflen++] = text[i];
+                buf[buflen] = '\0';
+            }
+            free(text);
+        }
+        else if (!iscntrl(c) && c < 128) 
+        {
+            if (buflen == bufsize - 1) 
+            {
+                bufsize *= 2;
+                buf = realloc(buf, bufsize);
+            }
+            buf[buflen++] = c;
+            buf[buflen] = '\0';
+        }
+        if (callback)
+        {
+            callback(buf, c);
+        }
+    }
+}
+
+
+//设置状态栏
+void set_status_message(const char *fmt, ...) 
+{
+    va_list ap;
+    va_start(ap, fmt);
+    vsnprintf(G.statusmsg, sizeof(G.statusmsg), fmt, ap);
+    va_end(ap);
+    G.statusmsg_time = time(NULL);
+}
+
+void draw_message_bar(struct buffer *ab) 
+{
+    int y = G.screenrows + 1 + pane_rows();
+    screen_clear_line(y);
+    int msglen = strlen(G.statusmsg);
+    if (msglen > G.screencols)
+    {
+        msglen = G.screencols;
+    }
+    if (msglen && time(NULL) - G.statusmsg_time < 5)
+    {
+        cells_put(y, 0, G.statusmsg, msglen, 0);
+    }
+    screen_flush_line(ab, y);
+}
+
+
+
+/*-----------------------文件操作--------------------------*/
+
+//为了处理Tab这种一个符号占多个字符的情况，需建立字符索引和符号索引并相互转换
+//Tab表在slab里紧跟字符段
+static long *row_tabs(erow *row)
+{
+    return (long *)(row->slab + row->cap);
+}
+
+//第cx个字符之前有几个Tab，在Tab表里二分查找
+static long tab_index(erow *row, long cx)
+{
+    long *tabs = row_tabs(row);
+    long lo = 0;
+    long hi = row->ntabs;
+    while (lo < hi)
+    {
+        long mid = (lo + hi) / 2;
+        if (tabs[2 * mid] < cx)
+        {
+            lo = mid + 1;
+        }
+        else
+        {
+            hi = mid;
+        }
+    }
+    return lo;
+}
+
+//字符索引转为符号索引：找到cx之前的最后一个Tab，从它展开后的位置往后数
+long cx_to_rx(erow *row, long cx) 
+{
+    if (row->render == NULL)
+    {
+        row_update_render(row, 0);
+    }
+    long k = tab_index(row, cx);
+    if (k == 0)
+    {
+        return cx;
+    }
+    long *tabs = row_tabs(row);
+    return tabs[2 * k - 1] + (cx - tabs[2 * k - 2] - 1);
+}
+
+//符号索引转为字符索引：找到展开后结束位置不超过rx的Tab个数，落在下一个Tab展开的空格里时返回该Tab
+long rx_to_cx(erow *row, long rx) 
+{
+    if (row->render == NULL)
+    {
+        row_update_render(row, 0);
+    }
+    long *tabs = row_tabs(row);
+    long lo = 0;
+    long hi = row->ntabs;
+    while (lo < hi)
+    {
+        long mid = (lo + hi) / 2;
+        if (tabs[2 * mid + 1] <= rx)
+        {
+            lo = mid + 1;
+        }
+        else
+        {
+            hi = mid;
+        }
+    }
+    long cx = (lo == 0) ? rx : tabs[2 * lo - 2] + 1 + (rx - tabs[2 * lo - 1]);
+    if (lo < row->ntabs && cx > tabs[2 * lo])
+    {
+        cx = tabs[2 * lo];
+    }
+    if (cx > row->size)
+    {
+        cx = row->size;
+    }
+    return cx;
+}
+
+
+//找出第一个特殊字节(Tab或其他控制字符：小于0x20或等于0x7f)的位置，没有则返回len
+static long find_special_scalar(const char *s, long len)
+{
+    for (long i = 0; i < len; i++)
+    {
+        unsigned char c = s[i];
+        if (c < 0x20 || c == 0x7f)
+        {
+            return i;
+        }
+    }
+    return len;
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+//每次比较16字节
+__attribute__((target("sse2")))
+static long find_special_sse2(const char *s, long len)
+{
+    const __m128i limit = _mm_set1_epi8(0x1f);
+    const __m128i del = _mm_set1_epi8(0x7f);
+    long i = 0;
+    for (; i + 16 <= len; i += 16)
+    {
+        __m128i x = _mm_loadu_si128((const __m128i *)&s[i]);
+        __m128i low = _mm_cmpeq_epi8(_mm_min_epu8(x, limit), x);
+        int mask = _mm_movemask_epi8(_mm_or_si128(low, _mm_cmpeq_epi8(x, del)));
+        if (mask)
+        {
+            return i + __builtin_ctz(mask);
+        }
+    }
+    return i + find_special_scalar(&s[i], len - i);
+}
+
+//每次比较32字节
+__attribute__((target("avx2")))
+static long find_special_avx2(const char *s, long len)
+{
+    const __m256i limit = _mm256_set1_epi8(0x1f);
+    const __m256i del = _mm256_set1_epi8(0x7f);
+    long i = 0;
+    for (; i + 32 <= len; i += 32)
+    {
+        __m256i x = _mm256_loadu_si256((const __m256i *)&s[i]);
+        __m256i low = _mm256_cmpeq_epi8(_mm256_min_epu8(x, limit), x);
+        unsigned int mask = _mm256_movemask_epi8(_mm256_or_si256(low, _mm256_cmpeq_epi8(x, del)));
+        if (mask)
+        {
+            return i + __builtin_ctz(mask);
+        }
+    }
+    return i + find_special_scalar(&s[i], len - i);
+}
+#endif
+
+static long find_special_select(const char *s, long len);
+
+//按CPU支持的指令集选用的实现，第一次调用时确定
+static long (*find_special_impl)(const char *s, long len) = find_special_select;
+
+static long find_special_select(const char *s, long len)
+{
+    find_special_impl = find_special_scalar;
+#if defined(__x86_64__) || defined(__i386__)
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2"))
+    {
+        find_special_impl = find_special_avx2;
+    }
+    else if (__builtin_cpu_supports("sse2"))
+    {
+        find_special_impl = find_special_sse2;
+    }
+#endif
+    return find_special_impl(s, len);
+}
+
+long find_special(const char *s, long len)
+{
+    return find_special_impl(s, len);
+}
+
+//render的来源
+enum render_kind 
+{
+    RENDER_NONE = 0,      //还没有生成
+    RENDER_SHARED,        //没有Tab，与chars共用
+    RENDER_OWN            //在slab里
+};
+
+static int row_render_kind(erow *row)
+{
+    return (row->render == NULL) ? RENDER_NONE : (row->render == row->chars) ? RENDER_SHARED : RENDER_OWN;
+}
+
+//slab分配或挪动后，按各段的位置重新设置chars和render
+static void row_point(erow *row, int kind)
+{
+    if (row->store == ROW_SLAB)
+    {
+        row->chars = row->slab;
+    }
+    else if (row->store == ROW_INL)
+    {
+        row->chars = row->inl;
+    }
+    row->render = (kind == RENDER_NONE) ? NULL
+                : (kind == RENDER_SHARED) ? row->chars
+                : row->slab + row->cap + row->ntabs * 2 * (long)sizeof(long);
+}
+
+//高亮段在slab里的起点：render之后按8字节对齐，先是段数，后面是各段
+static long row_spans_at(erow *row)
+{
+    long at = row->cap + row->ntabs * 2 * (long)sizeof(long) + ((row_render_kind(row) == RENDER_OWN) ? row->rsize + 1 : 0);
+    return (at + 7) & ~7L;
+}
+
+//slab的总长度
+static long row_slab_size(erow *row)
+{
+    if (row->has_hl)
+    {
+        long at = row_spans_at(row);
+        return at + sizeof(long) + *(long *)(row->slab + at) * sizeof(struct hl_span);
+    }
+    return row->cap + row->ntabs * 2 * (long)sizeof(long) + ((row_render_kind(row) == RENDER_OWN) ? row->rsize + 1 : 0);
+}
+
+//按新的字符存放位置与容量、Tab数和render长度重排slab，保留字符、前keep_tabs个Tab和render的前keep_render字节
+//高亮段在最后，重排后作废，显示时再生成
+static void row_layout(erow *row, int store, long cap, long ntabs, long rsize, int kind, long keep_tabs, long keep_render)
+{
+    int old_kind = row_render_kind(row);
+    long old_t = row->cap;
+    long old_r = old_t + row->ntabs * 2 * (long)sizeof(long);
+    long old_end = row_slab_size(row);
+    long old_derived = old_end - row->cap;
+    long t = cap;
+    long r = t + ntabs * 2 * (long)sizeof(long);
+    long end = r + ((kind == RENDER_OWN) ? rsize + 1 : 0);
+
+    if (end > old_end)
+    {
+        row->slab = realloc(row->slab, end);
+    }
+    //往前挪的段先挪，往后挪的段后挪，各段之间不会互相覆盖
+    long tab_bytes = keep_tabs * 2 * (long)sizeof(long);
+    long render_bytes = (old_kind == RENDER_OWN && kind == RENDER_OWN) ? keep_render : 0;
+    if (tab_bytes > 0 && t < old_t)
+    {
+        memmove(row->slab + t, row->slab + old_t, tab_bytes);
+    }
+    if (render_bytes > 0)
+    {
+        memmove(row->slab + r, row->slab + old_r, render_bytes);
+    }
+    if (tab_bytes > 0 && t > old_t)
+    {
+        memmove(row->slab + t, row->slab + old_t, tab_bytes);
+    }
+    //字符换了存放位置
+    if (store == ROW_SLAB && row->store != ROW_SLAB)
+    {
+        memcpy(row->slab, row->chars, row->size);
+        row->slab[row->size] = '\0';
+    }
+    else if (store == ROW_INL && row->store == ROW_MAPPED)
+    {
+        memcpy(row->inl, row->chars, row->size);
+        row->inl[row->size] = '\0';
+    }
+    if (end < old_end)
+    {
+        if (end == 0)
+        {
+            free(row->slab);
+            row->slab = NULL;
+        }
+        else
+        {
+            row->slab = realloc(row->slab, end);
+        }
+    }
+
+    row->store = store;
+    row->cap = cap;
+    row->ntabs = ntabs;
+    row->rsize = rsize;
+    row_point(row, kind);
+    if (kind == RENDER_OWN && old_kind == RENDER_SHARED && keep_render > 0)
+    {
+        memcpy(row->render, row->chars, keep_render);
+    }
+    row->has_hl = 0;
+    row->hl_gen = 0;
+    G.rcache.bytes += (end - cap) - old_derived;
+}
+
+//修改字符前保证字符段至少能放下need个字节：映射的行复制出来，短行放在行结构里，长行放在slab开头并留出余量
+static void row_reserve(erow *row, long need)
+{
+    if ((row->store == ROW_SLAB && need <= row->cap) || (row->store == ROW_INL && need <= ROW_INLINE))
+    {
+        return;
+    }
+    int store = (need <= ROW_INLINE && row->store != ROW_SLAB) ? ROW_INL : ROW_SLAB;
+    long cap = (store == ROW_SLAB) ? ((need + need / 8 + 7) & ~7L) : 0;
+    int kind = row_render_kind(row);
+    row_layout(row, store, cap, row->ntabs, row->rsize, kind, row->ntabs, (kind == RENDER_OWN) ? row->rsize + 1 : 0);
+}
+
+//取得本行的高亮段，*n为段数，还没有生成时返回NULL
+struct hl_span *row_spans(erow *row, long *n)
+{
+    if (!row->has_hl)
+    {
+        *n = 0;
+        return NULL;
+    }
+    long at = row_spans_at(row);
+    *n = *(long *)(row->slab + at);
+    return (struct hl_span *)(row->slab + at + sizeof(long));
+}
+
+//用n个高亮段替换slab最后的高亮段
+static void row_set_spans(erow *row, const struct hl_span *spans, long n)
+{
+    int kind = row_render_kind(row);
+    long at = row_spans_at(row);
+    G.rcache.bytes += (at + sizeof(long) + n * sizeof(struct hl_span)) - row_slab_size(row);
+    row->slab = realloc(row->slab, at + sizeof(long) + n * sizeof(struct hl_span));
+    row_point(row, kind);
+    *(long *)(row->slab + at) = n;
+    if (n > 0)
+    {
+        memcpy(row->slab + at + sizeof(long), spans, n * sizeof(struct hl_span));
+    }
+    row->has_hl = 1;
+}
+
+//行结构挪动位置后，存在行结构里的字符和与之共用的render改指新位置
+void row_fix(erow *row)
+{
+    if (row->store == ROW_INL && row->chars != row->inl)
+    {
+        row_point(row, row_render_kind(row));
+    }
+}
+
+//按Tab展开生成render和Tab表，并记下render中是否有控制字符；没有Tab时render直接用chars
+//from之前的字符没有变，只重新生成它之后的部分；先向量化找出特殊字节，没有Tab的部分整段复制
+void row_update_render(erow *row, long from) 
+{
+    if (row->render == NULL || from > row->size)
+    {
+        from = 0;
+    }
+    long k = (from > 0) ? tab_index(row, from) : 0;
+    long idx = (from > 0) ? cx_to_rx(row, from) : 0;
+    int ctrl = (from > 0) ? row->ctrl : 0;
+
+    //先数出Tab并算出展开后的长度，render的大小一次分配准确
+    long tabs = 0;
+    long rsize = idx;
+    long last = from;
+    long j = from;
+    while ((j += find_special(&row->chars[j], row->size - j)) < row->size)
+    {
+        if (row->chars[j] == '\t')
+        {
+            rsize += j - last;
+            rsize += TAB_STOP - rsize % TAB_STOP;
+            last = j + 1;
+            tabs++;
+        }
+        else
+        {
+            ctrl = 1;
+        }
+        j++;
+    }
+    rsize += row->size - last;
+
+    row->ctrl = ctrl;
+    if (k + tabs == 0)
+    {
+        row_layout(row, row->store, row->cap, 0, row->size, RENDER_SHARED, 0, 0);
+        return;
+    }
+    row_layout(row, row->store, row->cap, k + tabs, rsize, RENDER_OWN, k, idx);
+    long *t = row_tabs(row);
+
+    if (tabs == 0)
+    {
+        memcpy(&row->render[idx], &row->chars[from], row->size - from);
+        row->render[row->rsize] = '\0';
+        return;
+    }
+
+    j = from;
+    while (j < row->size) 
+    {
+        long run = find_special(&row->chars[j], row->size - j);
+        memcpy(&row->render[idx], &row->chars[j], run);
+        idx += run;
+        j += run;
+        if (j == row->size)
+        {
+            break;
+        }
+        if (row->chars[j] == '\t') 
+        {
+            row->render[idx++] = ' ';
+            while (idx % TAB_STOP != 0)
+            {
+                row->render[idx++] = ' ';
+            }
+            t[2 * k] = j;
+            t[2 * k + 1] = idx;
+            k++;
+        } 
+        else 
+        {
+            row->render[idx++] = row->chars[j];
+        }
+        j++;
+    }
+    row->render[idx] = '\0';
+}
+
+//行内容改变后更新render，from之前的字符没有变；还没显示过的行不生成render，高亮和注释状态留到显示时重新计算
+void update_row(int filerow, long from) 
+{
+    erow *row = row_at(filerow);
+    if (row->render)
+    {
+        row_update_render(row, from);
+    }
+    row->gen = ++G.gen;
+    hl_invalidate(filerow);
+    search_reset();
+}
+
+//插入字符
+void row_insert_char(int filerow, long at, int c) 
+{
+    erow *row = row_at(filerow);
+    if (at < 0 || at > row->size)
+    {
+        at = row->size;
+    }
+    char ch = c;
+    undo_record(UNDO_INSERT, filerow, at, &ch, 1);
+    row_reserve(row, row->size + 2);
+    memmove(&row->chars[at + 1], &row->chars[at], row->size - at + 1);
+    row->size++;
+    row->chars[at] = c;
+    update_row(filerow, at);
+    G.dirty++;
+}
+
+
+//Enter键插入新行
+void insert_new_line() 
+{
+    if (G.cx == 0) 
+    {
+        editor_insert_row(G.cy, "", 0);
+    } 
+    else 
+    {
+        erow *row = row_at(G.cy);
+        editor_insert_row(G.cy + 1, &row->chars[G.cx], row->size - G.cx);
+        //在行尾回车时没有要挪到下一行的字符，不记一条空的删除
+        row = row_at(G.cy);
+        if (G.cx < row->size)
+        {
+            row_delete_string(G.cy, G.cx, row->size - G.cx);
+        }
+    }
+    G.cy++;
+    G.cx = 0;
+}
+
+void row_append_string(int filerow, char *s, size_t len) 
+{
+    erow *row = row_at(filerow);
+    undo_record(UNDO_INSERT, filerow, row->size, s, len);
+    row_reserve(row, row->size + len + 1);
+    memcpy(&row->chars[row->size], s, len);
+    long from = row->size;
+    row->size += len;
+    row->chars[row->size] = '\0';
+    update_row(filerow, from);
+    G.dirty++;
+}
+
+
+
+//实现退格各种功能
+void row_del_char(int filerow, long at) 
+{
+    erow *row = row_at(filerow);
+    if (at < 0 || at >= row->size)
+    {
+        return;
+    }
+    undo_record(UNDO_DELETE, filerow, at, &row->chars[at], 1);
+    row_reserve(row, row->size + 1);
+    memmove(&row->chars[at], &row->chars[at + 1], row->size - at);
+    row->size--;
+    update_row(filerow, at);
+    G.dirty++;
+}
+
+
+//在第filerow行的at处插入一段不含换行的字符
+void row_insert_string(int filerow, long at, const char *s, long len)
+{
+    erow *row = row_at(filerow);
+    undo_record(UNDO_INSERT, filerow, at, s, len);
+    row_reserve(row, row->size + len + 1);
+    memmove(&row->chars[at + len], &row->chars[at], row->size - at + 1);
+    memcpy(&row->chars[at], s, len);
+    row->size += len;
+    update_row(filerow, at);
+    G.dirty++;
+}
+
+//删除第filerow行从at起的len个字符
+void row_delete_string(int filerow, long at, long len)
+{
+    erow *row = row_at(filerow);
+    undo_record(UNDO_DELETE, filerow, at, &row->chars[at], len);
+    row_reserve(row, row->size + 1);
+    memmove(&row->chars[at], &row->chars[at + len], row->size - at - len + 1);
+    row->size -= len;
+    update_row(filerow, at);
+    G.dirty++;
+}
+
+//取得用于显示的行，行第一次显示时才生成render
+//高亮过期时，注释状态缓存就在附近则当场重新生成；否则先借用旧的高亮(长度对不上就显示为普通文本)，等后台线程算好再重画
+erow *row_render(int filerow)
+{
+    erow *row = row_at(filerow);
+    rcache_touch(G.rows.hint, G.rcache.clock);
+    if (row->render == NULL)
+    {
+        row_update_render(row, 0);
+    }
+    if (hl_fresh(filerow))
+    {
+        return row;
+    }
+    if (!G.threaded || filerow - G.hl_frontier <= HL_SYNC_ROWS)
+    {
+        update_syntax(filerow);
+    }
+    else if (!row->has_hl)
+    {
+        row_set_spans(row, NULL, 0);
+    }
+    return row;
+}
+
+//丢掉行的render、Tab表和高亮段，只留字符，注释状态缓存还在，再显示时很快就能重新生成
+void row_drop(erow *row)
+{
+    row_layout(row, row->store, row->cap, 0, 0, RENDER_NONE, 0, 0);
+}
+
+static int rcache_cmp(const void *a, const void *b)
+{
+    unsigned int x = (*(struct row_leaf *const *)a)->used;
+    unsigned int y = (*(struct row_leaf *const *)b)->used;
+    return (x > y) - (x < y);
+}
+
+//render缓存超出上限时，按最近显示的帧号从旧到新整叶丢掉，直到降到上限的3/4；本帧显示的叶子不丢
+void rcache_trim()
+{
+    struct render_cache *c = &G.rcache;
+    if (c->bytes <= c->limit)
+    {
+        return;
+    }
+    qsort(c->leaves, c->n, sizeof(struct row_leaf *), rcache_cmp);
+    int i = 0;
+    for (; i < c->n && c->bytes > c->limit / 4 * 3 && c->leaves[i]->used != c->clock; i++)
+    {
+        struct row_leaf *leaf = c->leaves[i];
+        for (int j = 0; j < leaf->n; j++)
+        {
+            if (leaf->rows[j].render || leaf->rows[j].has_hl)
+            {
+                row_drop(&leaf->rows[j]);
+            }
+        }
+        leaf->cached = -1;
+    }
+    memmove(c->leaves, &c->leaves[i], sizeof(struct row_leaf *) * (c->n - i));
+    c->n -= i;
+    for (i = 0; i < c->n; i++)
+    {
+        c->leaves[i]->cached = i;
+    }
+}
+
+//删除行
+void free_row(erow *row) 
+{
+    G.rcache.bytes -= row_slab_size(row) - row->cap;
+    free(row->slab);
+}
+
+//行首退格删除行
+void editor_del_row(int at) 
+{
+    if (at < 0 || at >= G.numrows)
+    {
+        return;
+    }
+    erow *row = row_at(at);
+    undo_record(UNDO_DELETE_ROWS, at, 1, row->chars, row->size);
+    if (row->state_epoch != G.hl_epoch)
+    {
+        G.hl_dirty_rows--;
+    }
+    free_row(row);
+    row_tree_delete(at);
+    G.numrows--;
+    hl_invalidate(at);
+    search_reset();
+    G.dirty++;
+}
+
+//行首退格将本行字符串附加到上一行行尾
+void editor_insert_row(int at, char *s, size_t len) 
+{
+    if (at < 0 || at > G.numrows)
+    {
+        return;
+    }
+    undo_record(UNDO_INSERT_ROWS, at, 1, s, len);
+
+    //s可能是某个短行存在行结构里的字符，插入时会被挪走，先复制出新行
+    erow tmp;
+    row_init(&tmp, s, len, 0);
+    erow *row = row_tree_insert(at);
+    *row = tmp;
+    row_fix(row);
+    G.numrows++;
+
+    hl_invalidate(at);
+    hl_invalidate(at + 1);
+    search_reset();
+
+    G.dirty++;
+}
+
+//初始化新行，mapped为0时复制字符：短行存在行结构里，长行放在slab开头；render和hl留到第一次显示时生成
+void row_init(erow *row, const char *chars, long size, int mapped)
+{
+    row->size = size;
+    row->rsize = 0;
+    row->render = NULL;
+    row->has_hl = 0;
+    row->slab = NULL;
+    row->cap = 0;
+    row->ntabs = 0;
+    row->ctrl = 0;
+    if (mapped)
+    {
+        row->store = ROW_MAPPED;
+        row->chars = (char *)chars;
+    }
+    else if (size < ROW_INLINE)
+    {
+        row->store = ROW_INL;
+        row->chars = row->inl;
+    }
+    else
+    {
+        row->store = ROW_SLAB;
+        row->cap = (size + 1 + 7) & ~7L;
+        row->slab = malloc(row->cap);
+        row->chars = row->slab;
+    }
+    if (!mapped)
+    {
+        memcpy(row->chars, chars, size);
+        row->chars[size] = '\0';
+    }
+    row->hl_open_comment = 0;
+    row->hl_entry = 0;
+    row->gen = ++G.gen;
+    row->hl_gen = 0;
+    row->hl_epoch = G.hl_epoch - 1;
+    row->state_epoch = G.hl_epoch - 1;
+    G.hl_dirty_rows++;
+}
+
+//映射打开大文件，只记录每行在映射中的位置，行数据在显示或修改时才生成
+int editor_open_mapped(int fd, size_t len)
+{
+    char *map = mmap(NULL, len, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (map == MAP_FAILED)
+    {
+        return -1;
+    }
+    madvise(map, len, MADV_SEQUENTIAL);
+
+    struct row_builder b = {NULL, 0, 0, 0};
+    char *p = map;
+    char *end = map + len;
+    while (p < end)
+    {
+        char *eol = memchr(p, '\n', end - p);
+        if (eol == NULL)
+        {
+            eol = end;
+        }
+        size_t linelen = eol - p;
+        while (linelen > 0 && p[linelen - 1] == '\r')
+        {
+            linelen--;
+        }
+
+        row_init(row_builder_push(&b), p, linelen, 1);
+        p = eol + 1;
+    }
+    row_builder_finish(&b);
+
+    madvise(map, len, MADV_NORMAL);
+    G.map = map;
+    G.map_len = len;
+    return 0;
+}
+
+//把一行复制进批量建树，去掉行尾的\r
+void load_push_line(struct row_builder *b, const char *s, size_t len)
+{
+    while (len > 0 && s[len - 1] == '\r')
+    {
+        len--;
+    }
+    row_init(row_builder_push(b), s, len, 0);
+}
+
+//分块读入文件并直接切分成行，不逐行插入也不在载入时做高亮
+void editor_load(int fd)
+{
+    struct row_builder b = {NULL, 0, 0, 0};
+    char *block = malloc(LOAD_BLOCK);
+    char *carry = NULL;          //跨越块边界的半行
+    size_t carrylen = 0;
+    size_t carrycap = 0;
+    ssize_t n;
+
+    while ((n = read(fd, block, LOAD_BLOCK)) != 0)
+    {
+        if (n == -1)
+        {
+            if (errno == EINTR)
+            {
+                continue;
+            }
+            warn("read");
+        }
+
+        char *p = block;
+        char *end = block + n;
+        while (p < end)
+        {
+            char *eol = memchr(p, '\n', end - p);
+            size_t len = (eol ? eol : end) - p;
+            if (eol == NULL || carrylen)
+            {
+                if (carrylen + len > carrycap)
+                {
+                    carrycap = (carrylen + len) * 2;
+                    carry = realloc(carry, carrycap);
+                }
+                memcpy(carry + carrylen, p, len);
+                carrylen += len;
+                if (eol == NULL)
+                {
+                    break;
+                }
+                load_push_line(&b, carry, carrylen);
+                carrylen = 0;
+            }
+            else
+            {
+                load_push_line(&b, p, len);
+            }
+            p = eol + 1;
+        }
+    }
+    if (carrylen)
+    {
+        load_push_line(&b, carry, carrylen);
+    }
+
+    row_builder_finish(&b);
+    free(carry);
+    free(block);
+}
+
+//打开文件
+void editor_open(char *filename) 
+{
+    free(G.filename);
+    G.filename = strdup(filename);
+
+    select_highlight();
+
+    int fd = open(filename, O_RDONLY);
+    if (fd == -1)
+    {
+        warn("open");
+    } 
+
+    struct stat st;
+    if (fstat(fd, &st) == -1 || !S_ISREG(st.st_mode) || st.st_size < LAZY_OPEN_SIZE ||
+        editor_open_mapped(fd, st.st_size) == -1)
+    {
+        editor_load(fd);
+    }
+    close(fd);
+    G.dirty = 0;
+    undo_clear();
+    swap_attach();
+}
+
+//把所有行依次写入fd，每次writev提交一批行，不再把整个文件拼成一块内存；返回写入的字节数，出错返回-1
+static long long save_rows(int fd)
+{
+    struct iovec iov[SAVE_IOV];
+    long long total = 0;
+    int j = 0;
+    while (j < G.numrows)
+    {
+        int n = 0;
+        for (; j < G.numrows && n + 2 <= SAVE_IOV; j++)
+        {
+            erow *row = row_at(j);
+            iov[n].iov_base = row->chars;
+            iov[n].iov_len = row->size;
+            iov[n + 1].iov_base = (char *)"\n";
+            iov[n + 1].iov_len = 1;
+            n += 2;
+        }
+        struct iovec *v = iov;
+        while (n > 0)
+        {
+            ssize_t w = writev(fd, v, n);
+            if (w == -1)
+            {
+                if (errno == EINTR)
+                {
+                    continue;
+                }
+                return -1;
+            }
+            total += w;
+            //跳过已写完的部分，没写完的一段从剩下的位置接着写
+            while (n > 0 && (size_t)w >= v->iov_len)
+            {
+                w -= v->iov_len;
+                v++;
+                n--;
+            }
+            if (n > 0)
+            {
+                v->iov_base = (char *)v->iov_base + w;
+                v->iov_len -= w;
+            }
+        }
+    }
+    return total;
+}
+
+//把改名写入磁盘：对文件所在目录做fsync
+static int save_sync_dir(const char *path)
+{
+    char *dir = strdup(path);
+    char *slash = strrchr(dir, '/');
+    if (slash == NULL)
+    {
+        strcpy(dir, ".");
+    }
+    else
+    {
+        slash[slash == dir] = '\0';
+    }
+    int fd = open(dir, O_RDONLY | O_DIRECTORY);
+    free(dir);
+    if (fd == -1)
+    {
+        return -1;
+    }
+    int ret = fsync(fd);
+    close(fd);
+    return ret;
+}
+
+//保存内容到磁盘
+void save() 
+{
+    if (G.filename == NULL) 
+    {
+        G.filename = editor_prompt("Save as: %s (ESC to cancel)", NULL);
+        if (G.filename == NULL) 
+        {
+            set_status_message("Save aborted");
+            return;
+        }
+        select_highlight();
+    }
+
+    //先写入同一目录下的临时文件，写完再改名替换原文件：中途出错或崩溃时原文件保持完整，
+    //映射打开的文件仍被未修改的行引用，替换后旧内容也一直有效；文件是符号链接时替换它指向的文件
+    char *target = realpath(G.filename, NULL);
+    if (target == NULL)
+    {
+        target = strdup(G.filename);
+    }
+    char *path = malloc(strlen(target) + 8);
+    sprintf(path, "%s.XXXXXX", target);
+
+    long long len = -1;
+    int err = 0;
+    int fd = mkstemp(path);
+    if (fd != -1) 
+    {
+        struct stat st;
+        if (stat(target, &st) == 0)
+        {
+            fchmod(fd, st.st_mode & 07777);
+            if (fchown(fd, st.st_uid, st.st_gid) == -1)
+            {
+                //没有权限改属主时保存为自己的文件
+            }
+        }
+        else
+        {
+            mode_t mask = umask(0);
+            umask(mask);
+            fchmod(fd, 0644 & ~mask);
+        }
+        len = save_rows(fd);
+        if (len != -1 && SAVE_FSYNC && fsync(fd) == -1)
+        {
+            len = -1;
+        }
+        err = errno;
+        if (close(fd) == -1 && len != -1)
+        {
+            len = -1;
+            err = errno;
+        }
+        if (len != -1 && rename(path, target) == -1)
+        {
+            len = -1;
+            err = errno;
+        }
+        if (len != -1 && SAVE_FSYNC)
+        {
+            save_sync_dir(target);
+        }
+    }
+    else
+    {
+        err = errno;
+    }
+    if (len == -1 && fd != -1)
+    {
+        unlink(path);
+    }
+    free(path);
+    free(target);
+
+    if (len == -1)
+    {
+        set_status_message("Can't save! I/O error: %s", strerror(err));
+        return;
+    }
+    G.dirty = 0;
+    undo_mark_saved();
+    swap_saved();
+    set_status_message("%lld bytes written to disk", len);
+}
+
+/*--------------------------编辑器操作------------------*/
+
+//编辑器调用editorRowInsertChar函数实现添加字符功能
+void editor_insert_char(int c) 
+{
+    if (G.cy == G.numrows) 
+    {
+        editor_insert_row(G.numrows, "", 0);
+    }
+    row_insert_char(G.cy, G.cx, c);
+    G.cx++;
+}
+
+//在光标处插入一段文本：按换行一次切成各行，中间各行直接建成新行
+//render和高亮仍留到显示时生成，每行各处理一次；光标移到插入的文本之后
+void editor_insert_text(const char *s, long len) 
+{
+    if (len == 0)
+    {
+        return;
+    }
+    //光标在末行之后时与逐字输入一致：插入的全是换行时光标仍停在末行之后
+    int past_end = (G.cy == G.numrows);
+    for (long i = 0; past_end && i < len; i++)
+    {
+        if (s[i] != '\n')
+        {
+            past_end = 0;
+        }
+    }
+    if (G.cy == G.numrows) 
+    {
+        editor_insert_row(G.numrows, "", 0);
+    }
+    const char *nl = memchr(s, '\n', len);
+    if (nl == NULL)
+    {
+        row_insert_string(G.cy, G.cx, s, len);
+        G.cx += len;
+        return;
+    }
+
+    //插入点之后的内容留给最后一行
+    erow *row = row_at(G.cy);
+    long tail_len = row->size - G.cx;
+    char *tail = malloc(tail_len + 1);
+    memcpy(tail, &row->chars[G.cx], tail_len);
+    if (tail_len > 0)
+    {
+        row_delete_string(G.cy, G.cx, tail_len);
+    }
+    if (nl > s)
+    {
+        row_insert_string(G.cy, G.cx, s, nl - s);
+    }
+
+    const char *p = nl + 1;
+    const char *end = s + len;
+    int at = G.cy + 1;
+    while ((nl = memchr(p, '\n', end - p)) != NULL)
+    {
+        editor_insert_row(at++, (char *)p, nl - p);
+        p = nl + 1;
+    }
+    long last = end - p;
+    char *line = malloc(last + tail_len + 1);
+    memcpy(line, p, last);
+    memcpy(&line[last], tail, tail_len);
+    if (!past_end)
+    {
+        editor_insert_row(at, line, last + tail_len);
+    }
+    free(line);
+    free(tail);
+    G.cy = at;
+    G.cx = last;
+}
+
+//编辑器实现退格
+void editor_del_char() 
+{
+    if (G.cy == G.numrows)
+    {
+        return;
+    }
+    if (G.cx == 0 && G.cy == 0)
+    {
+        return;
+    }
+    erow *row = row_at(G.cy);
+    if (G.cx > 0) 
+    {
+        row_del_char(G.cy, G.cx - 1);
+        G.cx--;
+    } 
+    else 
+    {
+        G.cx = row_at(G.cy - 1)->size;
+        row_append_string(G.cy - 1, row->chars, row->size);
+        editor_del_row(G.cy);
+        G.cy--;
+    }
+}
+
+/*-----------------------撤销--------------------------*/
+
+//len字节内容的记录连同记录头占用的字节数，按8字节对齐
+static long undo_rec_bytes(long len)
+{
+    return sizeof(struct undo_rec) + ((len + 7) & ~7L);
+}
+
+//一条记录连同内容占用的字节数
+static long undo_rec_size(struct undo_rec *r)
+{
+    return undo_rec_bytes(r->len);
+}
+
+//清空撤销日志
+static void undo_clear()
+{
+    struct undo *u = &G.undo;
+    u->len = u->pos = 0;
+    u->last = -1;
+    u->saved = 0;
+}
+
+//日志再加need字节会超出上限时，从头丢掉最早的几组，只在keep之前的组边界处截断；截到keep仍放不下时不动日志，返回0
+static int undo_trim(long need, long keep)
+{
+    struct undo *u = &G.undo;
+    if (u->len + need <= u->limit)
+    {
+        return 1;
+    }
+    long cut = -1;
+    long off = 0;
+    while (off < keep)
+    {
+        off += undo_rec_size((struct undo_rec *)&u->buf[off]);
+        if (off == keep || (off < keep && ((struct undo_rec *)&u->buf[off])->group))
+        {
+            cut = off;
+            if (u->len - cut + need <= u->limit)
+            {
+                break;
+            }
+        }
+    }
+    if (cut < 0 || u->len - cut + need > u->limit)
+    {
+        return 0;
+    }
+    memmove(u->buf, &u->buf[cut], u->len - cut);
+    u->len -= cut;
+    u->pos -= cut;
+    u->last = (u->len > 0) ? u->last - cut : -1;
+    u->gstart -= cut;
+    u->saved = (u->saved >= cut) ? u->saved - cut : -1;
+    if (u->len > 0)
+    {
+        ((struct undo_rec *)u->buf)->prev = 0;
+    }
+    return 1;
+}
+
+//本组放不下：清空日志并放弃记录本组
+static void undo_overflow()
+{
+    struct undo *u = &G.undo;
+    undo_clear();
+    u->saved = -1;
+    u->overflow = 1;
+    set_status_message("Edit too large to undo");
+}
+
+//保证日志末尾还能写need字节
+static void undo_reserve(long need)
+{
+    struct undo *u = &G.undo;
+    if (u->len + need > u->cap)
+    {
+        u->cap = (u->len + need > u->cap * 2) ? u->len + need : u->cap * 2;
+        u->buf = realloc(u->buf, u->cap);
+    }
+}
+
+//把一行写成记录内容：行长度加字符
+static void undo_put_row(char *dst, const char *s, long len)
+{
+    memcpy(dst, &len, sizeof(long));
+    memcpy(dst + sizeof(long), s, len);
+}
+
+//新修改能否并入最后一条记录：同一组里的连续插入删除，或跨按键的逐字输入和连续退格
+static int undo_mergeable(struct undo_rec *r, int type, int row, long col, long len)
+{
+    struct undo *u = &G.undo;
+    if (u->sealed || r->type != type)
+    {
+        return 0;
+    }
+    if (u->group && (len != 1 || (type != UNDO_INSERT && type != UNDO_DELETE)))
+    {
+        return 0;
+    }
+    switch (type)
+    {
+        case UNDO_INSERT:
+            return row == r->row && col == r->col + r->len;
+        case UNDO_DELETE:
+            return row == r->row && (col + len == r->col || col == r->col);
+        case UNDO_INSERT_ROWS:
+            return row == r->row + r->col;
+        default:
+            return row == r->row;
+    }
+}
+
+//记录一次修改：插入删除字符时col为位置，插入删除行时col为行数(每次一行)，s与len是涉及的字符
+//撤销或重做中的修改不记录；之后的修改让撤销过的记录无法再重做
+void undo_record(int type, int row, long col, const char *s, long len)
+{
+    struct undo *u = &G.undo;
+    swap_record(type, row, col, s, len);
+    if (u->replaying || u->overflow)
+    {
+        return;
+    }
+    u->len = u->pos;
+    if (u->saved > u->pos)
+    {
+        u->saved = -1;
+    }
+    int rows = (type == UNDO_INSERT_ROWS || type == UNDO_DELETE_ROWS);
+    long add = rows ? (long)sizeof(long) + len : len;
+
+    //并入最后一条记录时不能截掉它；截到它仍放不下就另起一条记录
+    struct undo_rec *r = (u->last >= 0) ? (struct undo_rec *)&u->buf[u->last] : NULL;
+    long grow = r ? undo_rec_bytes(r->len + add) - undo_rec_size(r) : 0;
+    if (r && undo_mergeable(r, type, row, col, len) && undo_trim(grow, u->group ? u->last : u->gstart))
+    {
+        undo_reserve(grow);
+        r = (struct undo_rec *)&u->buf[u->last];
+        char *data = (char *)(r + 1);
+        if (type == UNDO_DELETE && col + len == r->col)
+        {
+            //退格：删掉的字符在已有内容之前
+            memmove(&data[len], data, r->len);
+            memcpy(data, s, len);
+            r->col = col;
+        }
+        else if (rows)
+        {
+            undo_put_row(&data[r->len], s, len);
+            r->col++;
+        }
+        else
+        {
+            memcpy(&data[r->len], s, len);
+        }
+        r->len += add;
+        u->len += grow;
+        u->pos = u->len;
+        u->group = 0;
+        return;
+    }
+
+    long size = undo_rec_bytes(add);
+    if (!undo_trim(size, u->group ? u->len : u->gstart))
+    {
+        undo_overflow();
+        return;
+    }
+    undo_reserve(size);
+    long prev = (u->last >= 0) ? u->len - u->last : 0;
+    r = (struct undo_rec *)&u->buf[u->len];
+    r->type = type;
+    r->group = u->group;
+    r->prev = prev;
+    r->row = row;
+    r->col = col;
+    r->len = add;
+    r->cx = u->gcx;
+    r->cy = u->gcy;
+    r->rcx = r->rcy = 0;
+    if (rows)
+    {
+        undo_put_row((char *)(r + 1), s, len);
+    }
+    else
+    {
+        memcpy(r + 1, s, len);
+    }
+    if (u->group)
+    {
+        u->gstart = u->len;
+        u->group = 0;
+    }
+    u->last = u->len;
+    u->len += size;
+    u->pos = u->len;
+    u->sealed = 0;
+}
+
+//每次按键之前调用：这次按键的修改记为新的一组，记下此时的光标
+void undo_begin()
+{
+    struct undo *u = &G.undo;
+    u->group = 1;
+    u->overflow = 0;
+    u->gcx = G.cx;
+    u->gcy = G.cy;
+}
+
+//保存后记下文件对应的位置，撤销重做回到这里时文件不算修改过；之后的输入不再并入之前的记录
+void undo_mark_saved()
+{
+    G.undo.saved = G.undo.pos;
+    G.undo.sealed = 1;
+}
+
+//执行一次记下的修改(undo为1时执行它的逆操作)，撤销重做和恢复交换文件共用
+static void undo_op(int type, int row, long col, char *data, long len, int undo)
+{
+    int insert = (type == UNDO_INSERT || type == UNDO_INSERT_ROWS) != undo;
+    if (type == UNDO_INSERT || type == UNDO_DELETE)
+    {
+        if (insert)
+        {
+            row_insert_string(row, col, data, len);
+        }
+        else
+        {
+            row_delete_string(row, col, len);
+        }
+        return;
+    }
+    long off = 0;
+    for (int k = 0; k < col; k++)
+    {
+        if (insert)
+        {
+            long n;
+            memcpy(&n, &data[off], sizeof(long));
+            editor_insert_row(row + k, &data[off + sizeof(long)], n);
+            off += sizeof(long) + n;
+        }
+        else
+        {
+            editor_del_row(row);
+        }
+    }
+}
+
+//执行一条撤销记录
+static void undo_apply(struct undo_rec *r, int undo)
+{
+    undo_op(r->type, r->row, r->col, (char *)(r + 1), r->len, undo);
+}
+
+//撤销或重做之后：光标放回有效位置，回到保存时的状态则文件不算修改过
+static void undo_finish(long cx, int cy)
+{
+    struct undo *u = &G.undo;
+    u->replaying = 0;
+    u->sealed = 1;
+    G.cy = (cy > G.numrows) ? G.numrows : cy;
+    long size = (G.cy < G.numrows) ? row_at(G.cy)->size : 0;
+    G.cx = (cx > size) ? size : cx;
+    G.dirty = (u->pos != u->saved);
+}
+
+//撤销最近一组修改：整组的记录倒序执行逆操作，中间不重画，光标回到这组修改之前
+void editor_undo()
+{
+    struct undo *u = &G.undo;
+    if (u->last < 0)
+    {
+        set_status_message("Nothing to undo");
+        return;
+    }
+    u->replaying = 1;
+    long cx = G.cx;
+    int cy = G.cy;
+    while (u->last >= 0)
+    {
+        struct undo_rec *r = (struct undo_rec *)&u->buf[u->last];
+        undo_apply(r, 1);
+        u->pos = u->last;
+        u->last = r->prev ? u->last - r->prev : -1;
+        if (r->group)
+        {
+            r->rcx = cx;
+            r->rcy = cy;
+            cx = r->cx;
+            cy = r->cy;
+            break;
+        }
+    }
+    undo_finish(cx, cy);
+}
+
+//重做最近撤销的一组修改，光标回到撤销前的位置
+void editor_redo()
+{
+    struct undo *u = &G.undo;
+    if (u->pos >= u->len)
+    {
+        set_status_message("Nothing to redo");
+        return;
+    }
+    u->replaying = 1;
+    struct undo_rec *first = (struct undo_rec *)&u->buf[u->pos];
+    do
+    {
+        struct undo_rec *r = (struct undo_rec *)&u->buf[u->pos];
+        undo_apply(r, 0);
+        u->last = u->pos;
+        u->pos += undo_rec_size(r);
+    } while (u->pos < u->len && !((struct undo_rec *)&u->buf[u->pos])->group);
+    undo_finish(first->rcx, first->rcy);
+}
+
+/*-----------------------交换文件--------------------------*/
+
+//交换文件的路径：与文件同一目录下的.文件名.swp
+static char *swap_path(const char *filename)
+{
+    const char *base = strrchr(filename, '/');
+    int dirlen = base ? base - filename + 1 : 0;
+    base = base ? base + 1 : filename;
+    char *path = malloc(strlen(filename) + 6);
+    sprintf(path, "%.*s.%s.swp", dirlen, filename, base);
+    return path;
+}
+
+//文件当前的大小和修改时间，文件不存在时大小记为-1
+static void swap_stat(struct swap_head *h)
+{
+    struct stat st;
+    memset(h, 0, sizeof(*h));
+    memcpy(h->magic, SWAP_MAGIC, sizeof(h->magic));
+    h->size = -1;
+    if (stat(G.filename, &st) == 0)
+    {
+        h->size = st.st_size;
+        h->mtime = st.st_mtim.tv_sec;
+        h->mtime_ns = st.st_mtim.tv_nsec;
+    }
+}
+
+//把len字节追加到待写入的缓冲，调用时持有G.swap.lock
+static void swap_append(const void *p, long len)
+{
+    struct swap *w = &G.swap;
+    if (w->len + len > w->cap)
+    {
+        w->cap = (w->len + len > w->cap * 2) ? w->len + len : w->cap * 2;
+        w->buf = realloc(w->buf, w->cap);
+    }
+    memcpy(&w->buf[w->len], p, len);
+    w->len += len;
+}
+
+//把一次修改记入交换文件，编码与撤销日志相同；连续输入和连续插入的行并成一条
+//只追加到内存，由后台线程定时写入文件
+void swap_record(int type, int row, long col, const char *s, long len)
+{
+    struct swap *w = &G.swap;
+    if (!w->started || w->path == NULL || w->replaying)
+    {
+        return;
+    }
+    int rows = (type == UNDO_INSERT_ROWS || type == UNDO_DELETE_ROWS);
+    pthread_mutex_lock(&w->lock);
+    if (w->failed)
+    {
+        pthread_mutex_unlock(&w->lock);
+        return;
+    }
+    int wake = (w->len == 0);
+    if (w->head)
+    {
+        struct swap_head h;
+        swap_stat(&h);
+        swap_append(&h, sizeof(h));
+        w->head = 0;
+    }
+
+    //记录紧挨着存放，不按对齐，记录头复制出来读写
+    struct swap_rec r;
+    if (w->last >= 0)
+    {
+        memcpy(&r, &w->buf[w->last], sizeof(r));
+    }
+    if (w->last < 0 || r.type != type || !((type == UNDO_INSERT && row == r.row && col == r.col + r.len) ||
+                                           (type == UNDO_INSERT_ROWS && row == r.row + r.col)))
+    {
+        r = (struct swap_rec){type, row, rows ? 0 : col, 0};
+        w->last = w->len;
+        swap_append(&r, sizeof(r));
+    }
+    if (rows)
+    {
+        swap_append(&len, sizeof(long));
+    }
+    swap_append(s, len);
+    r.len += len + (rows ? (long)sizeof(long) : 0);
+    r.col += rows;
+    memcpy(&w->buf[w->last], &r, sizeof(r));
+    pthread_mutex_unlock(&w->lock);
+    if (wake)
+    {
+        pthread_cond_signal(&w->cond);
+    }
+}
+
+//写出一批记录，还没有交换文件时先建立；调用时持有G.swap.io，出错后不再记录
+static void swap_write(const char *p, long len)
+{
+    struct swap *w = &G.swap;
+    if (w->fd == -1)
+    {
+        w->fd = open(w->path, O_WRONLY | O_CREAT | O_CLOEXEC, 0600);
+        if (w->fd != -1 && (flock(w->fd, LOCK_EX | LOCK_NB) == -1 || ftruncate(w->fd, 0) == -1))
+        {
+            close(w->fd);
+            w->fd = -1;
+        }
+    }
+    while (w->fd != -1 && len > 0)
+    {
+        ssize_t n = write(w->fd, p, len);
+        if (n == -1 && errno == EINTR)
+        {
+            continue;
+        }
+        if (n == -1)
+        {
+            break;
+        }
+        p += n;
+        len -= n;
+    }
+    if (w->fd == -1 || len > 0 || fdatasync(w->fd) == -1)
+    {
+        pthread_mutex_lock(&w->lock);
+        w->failed = 1;
+        pthread_mutex_unlock(&w->lock);
+    }
+}
+
+//交换文件的写入线程：有新记录时等SWAP_FLUSH_MS攒够一批再写，写文件时不持有G.swap.lock，不挡住编辑
+static void *swap_thread(void *arg)
+{
+    (void)arg;
+    struct swap *w = &G.swap;
+    char *out = NULL;
+    long cap = 0;
+    pthread_mutex_lock(&w->lock);
+    while (1)
+    {
+        while (w->len == 0)
+        {
+            pthread_cond_wait(&w->cond, &w->lock);
+        }
+        pthread_mutex_unlock(&w->lock);
+        usleep(SWAP_FLUSH_MS * 1000);
+
+        pthread_mutex_lock(&w->io);
+        pthread_mutex_lock(&w->lock);
+        //两块缓冲交换使用：写这一批时新的记录追加到另一块
+        char *tmp = w->buf;
+        w->buf = out;
+        out = tmp;
+        long tmp_cap = w->cap;
+        w->cap = cap;
+        cap = tmp_cap;
+        long len = w->len;
+        w->len = 0;
+        w->last = -1;
+        pthread_mutex_unlock(&w->lock);
+        if (len > 0)
+        {
+            swap_write(out, len);
+        }
+        pthread_mutex_unlock(&w->io);
+        pthread_mutex_lock(&w->lock);
+    }
+    return NULL;
+}
+
+//启动交换文件的写入线程，之后的修改才会记入交换文件
+void swap_start()
+{
+    pthread_t tid;
+    if (pthread_create(&tid, NULL, swap_thread, NULL) != 0)
+    {
+        return;
+    }
+    pthread_detach(tid);
+    G.swap.started = 1;
+}
+
+//删除交换文件，丢掉还没写入的记录；之后的修改从新的交换文件开始记
+void swap_remove()
+{
+    struct swap *w = &G.swap;
+    pthread_mutex_lock(&w->io);
+    pthread_mutex_lock(&w->lock);
+    w->len = 0;
+    w->last = -1;
+    w->head = 1;
+    w->failed = 0;
+    if (w->fd != -1)
+    {
+        close(w->fd);
+        w->fd = -1;
+    }
+    if (w->path)
+    {
+        unlink(w->path);
+    }
+    pthread_mutex_unlock(&w->lock);
+    pthread_mutex_unlock(&w->io);
+}
+
+//保存之后：旧的交换文件已经没用，文件改了名时换用新名字的交换文件
+void swap_saved()
+{
+    swap_remove();
+    pthread_mutex_lock(&G.swap.io);
+    free(G.swap.path);
+    G.swap.path = swap_path(G.filename);
+    pthread_mutex_unlock(&G.swap.io);
+}
+
+//检查一条记录能否用在当前内容上，交换文件损坏时不会越界
+static int swap_valid(struct swap_rec *r, const char *data)
+{
+    if (r->type > UNDO_DELETE_ROWS || r->row < 0 || r->col < 0 || r->len < 0)
+    {
+        return 0;
+    }
+    if (r->type == UNDO_INSERT || r->type == UNDO_DELETE)
+    {
+        if (r->row >= G.numrows)
+        {
+            return 0;
+        }
+        long size = row_at(r->row)->size;
+        return (r->type == UNDO_INSERT) ? r->col <= size : r->len <= size - r->col && r->col <= size;
+    }
+    if (r->row > G.numrows || (r->type == UNDO_DELETE_ROWS && r->col > G.numrows - r->row))
+    {
+        return 0;
+    }
+    long off = 0;
+    for (long k = 0; k < r->col; k++)
+    {
+        long n;
+        if (r->len - off < (long)sizeof(long))
+        {
+            return 0;
+        }
+        memcpy(&n, &data[off], sizeof(long));
+        if (n < 0 || n > r->len - off - (long)sizeof(long))
+        {
+            return 0;
+        }
+        off += sizeof(long) + n;
+    }
+    return off == r->len;
+}
+
+//打开文件后接上它的交换文件：上次没有正常退出时留下的修改按顺序重放，之后的修改接着追加
+//交换文件建立后文件又被改过时不能重放，丢掉旧的重新记
+static void swap_attach()
+{
+    struct swap *w = &G.swap;
+    free(w->path);
+    w->path = swap_path(G.filename);
+    w->head = 1;
+    int fd = open(w->path, O_RDWR | O_CLOEXEC);
+    if (fd == -1)
+    {
+        return;
+    }
+    if (flock(fd, LOCK_EX | LOCK_NB) == -1)
+    {
+        close(fd);
+        set_status_message("%s is in use by another editor, changes are not journaled", w->path);
+        free(w->path);
+        w->path = NULL;
+        return;
+    }
+
+    struct stat st;
+    char *buf = NULL;
+    long long size = 0;
+    if (fstat(fd, &st) == 0 && st.st_size >= (off_t)sizeof(struct swap_head))
+    {
+        size = st.st_size;
+        buf = malloc(size);
+        if (pread(fd, buf, size, 0) != size)
+        {
+            size = 0;
+        }
+    }
+    struct swap_head h;
+    swap_stat(&h);
+    long long off = 0;
+    int n = 0;
+    if (size > 0 && memcmp(buf, &h, sizeof(h)) == 0)
+    {
+        //重放时不再记入撤销日志和交换文件，恢复的修改之前不能撤销
+        off = sizeof(h);
+        w->replaying = 1;
+        G.undo.replaying = 1;
+        while (size - off >= (long long)sizeof(struct swap_rec))
+        {
+            struct swap_rec r;
+            memcpy(&r, &buf[off], sizeof(r));
+            char *data = &buf[off + sizeof(r)];
+            if (r.len > size - off - (long long)sizeof(r) || !swap_valid(&r, data))
+            {
+                break;
+            }
+            undo_op(r.type, r.row, r.col, data, r.len, 0);
+            off += sizeof(r) + r.len;
+            n++;
+        }
+        G.undo.replaying = 0;
+        w->replaying = 0;
+    }
+    else if (size > 0)
+    {
+        set_status_message("%s was left for an older version of the file, ignored", w->path);
+    }
+    free(buf);
+
+    //截掉写了一半的记录，之后从有效内容末尾接着追加
+    if (ftruncate(fd, off) == -1 || lseek(fd, off, SEEK_SET) == -1)
+    {
+        close(fd);
+        return;
+    }
+    w->fd = fd;
+    w->head = (off == 0);
+    if (n > 0)
+    {
+        G.cx = G.cy = 0;
+        G.dirty = n;
+        G.undo.saved = -1;
+        set_status_message("Recovered %d changes from %s", n, w->path);
+    }
+}
+
+/*-----------------------运行任务--------------------------*/
+
+//清空输出窗格的内容
+static void job_clear_output()
+{
+    struct job *j = &G.job;
+    j->len = 0;
+    if (j->lines_cap == 0)
+    {
+        j->lines_cap = 64;
+        j->lines = malloc(j->lines_cap * sizeof(int));
+    }
+    j->lines[0] = 0;
+    j->nlines = 1;
+    j->scroll = 0;
+}
+
+//追加子进程的输出并记下新行的起点，超过JOB_OUTPUT_MAX时从某一行开头丢掉较早的一半
+static void job_append(const char *s, int n)
+{
+    struct job *j = &G.job;
+    if (j->len + n > JOB_OUTPUT_MAX)
+    {
+        int k = 1;
+        while (k < j->nlines && j->lines[k] < j->len / 2)
+        {
+            k++;
+        }
+        int cut = (k < j->nlines) ? j->lines[k] : j->len;
+        memmove(j->out, &j->out[cut], j->len - cut);
+        j->len -= cut;
+        if (k == j->nlines)
+        {
+            //整段输出都没有换行，只剩一个空行
+            k = j->nlines - 1;
+            j->lines[k] = cut;
+        }
+        for (int i = k; i < j->nlines; i++)
+        {
+            j->lines[i - k] = j->lines[i] - cut;
+        }
+        j->nlines -= k;
+    }
+    if (j->len + n > j->cap)
+    {
+        j->cap = (j->len + n > j->cap * 2) ? j->len + n : j->cap * 2;
+        j->out = realloc(j->out, j->cap);
+    }
+    memcpy(&j->out[j->len], s, n);
+    const char *p = s;
+    const char *end = s + n;
+    while ((p = memchr(p, '\n', end - p)) != NULL)
+    {
+        p++;
+        if (j->nlines == j->lines_cap)
+        {
+            j->lines_cap *= 2;
+            j->lines = realloc(j->lines, j->lines_cap * sizeof(int));
+        }
+        j->lines[j->nlines++] = j->len + (p - s);
+        //往回翻看时新输出不挪动窗格里的内容
+        if (j->scroll > 0)
+        {
+            j->scroll++;
+        }
+    }
+    j->len += n;
+}
+
+//输出有几行，末尾换行符之后的空行不算
+static int job_lines()
+{
+    struct job *j = &G.job;
+    if (j->nlines > 1 && j->lines[j->nlines - 1] == j->len)
+    {
+        return j->nlines - 1;
+    }
+    return (j->len > 0) ? j->nlines : 0;
+}
+
+//读入子进程的新输出，检查它是否已结束；有变化返回1，调用者据此重画
+//每次最多读64KB，输出不停的任务也不会占住界面线程
+int job_poll()
+{
+    struct job *j = &G.job;
+    int changed = 0;
+    if (j->fd != -1)
+    {
+        char buf[4096];
+        ssize_t n = 0;
+        for (int k = 0; k < 16 && (n = read(j->fd, buf, sizeof(buf))) > 0; k++)
+        {
+            job_append(buf, n);
+            changed = 1;
+        }
+        if (n == 0 || (n == -1 && errno != EAGAIN && errno != EINTR))
+        {
+            close(j->fd);
+            j->fd = -1;
+            changed = 1;
+        }
+    }
+    if (j->pid > 0 && waitpid(j->pid, &j->status, WNOHANG) == j->pid)
+    {
+        j->pid = 0;
+        changed = 1;
+    }
+    return changed;
+}
+
+//保存后在子进程中用sh执行cmd，$1是当前文件名；标准输出和标准错误都接到非阻塞管道上
+//子进程自成一个进程组，终止任务时它派生的进程一起结束
+void job_start(const char *name, const char *cmd)
+{
+    struct job *j = &G.job;
+    if (j->pid > 0)
+    {
+        set_status_message("%s is still running, Ctrl-K to kill it", j->name);
+        return;
+    }
+    save();
+    if (G.filename == NULL || G.dirty)
+    {
+        return;
+    }
+
+    int fds[2];
+    if (pipe2(fds, O_CLOEXEC) == -1)
+    {
+        set_status_message("Can't run %s: %s", name, strerror(errno));
+        return;
+    }
+    pid_t pid = fork();
+    if (pid == -1)
+    {
+        close(fds[0]);
+        close(fds[1]);
+        set_status_message("Can't run %s: %s", name, strerror(errno));
+        return;
+    }
+    if (pid == 0)
+    {
+        //多线程进程fork后的子进程里只做exec前必需的系统调用
+        setpgid(0, 0);
+        int null = open("/dev/null", O_RDONLY);
+        dup2(null, STDIN_FILENO);
+        dup2(fds[1], STDOUT_FILENO);
+        dup2(fds[1], STDERR_FILENO);
+        execl("/bin/sh", "sh", "-c", cmd, "sh", G.filename, (char *)NULL);
+        _exit(127);
+    }
+    setpgid(pid, pid);
+    close(fds[1]);
+    fcntl(fds[0], F_SETFL, O_NONBLOCK);
+
+    if (j->fd != -1)
+    {
+        close(j->fd);
+    }
+    j->pid = pid;
+    j->fd = fds[0];
+    j->name = name;
+    j->status = 0;
+    j->kills = 0;
+    job_clear_output();
+    pane_show(1);
+}
+
+//终止正在运行的任务，第一次发SIGTERM，再按一次发SIGKILL
+void job_kill()
+{
+    struct job *j = &G.job;
+    if (j->pid <= 0)
+    {
+        set_status_message("No job is running");
+        return;
+    }
+    kill(-j->pid, j->kills++ ? SIGKILL : SIGTERM);
+}
+
+//输出窗格占用的屏幕行数，关闭时为0
+int pane_rows()
+{
+    return G.job.visible ? G.job.rows : 0;
+}
+
+//打开或关闭输出窗格：窗格占正文下方约三分之一的行，正文区相应变矮
+void pane_show(int show)
+{
+    struct job *j = &G.job;
+    if (show == j->visible)
+    {
+        return;
+    }
+    if (show)
+    {
+        int rows = (G.screenrows + 1) / 3;
+        if (rows < 2)
+        {
+            return;
+        }
+        j->rows = rows;
+        G.screenrows -= rows;
+    }
+    else
+    {
+        G.screenrows += j->rows;
+    }
+    j->visible = show;
+}
+
+//窗格向上(delta>0)或向下滚动delta行，滚到底后跟着新输出走
+void pane_scroll(int delta)
+{
+    struct job *j = &G.job;
+    if (!j->visible)
+    {
+        return;
+    }
+    int max = job_lines() - (j->rows - 1);
+    j->scroll += delta;
+    if (j->scroll > max)
+    {
+        j->scroll = max;
+    }
+    if (j->scroll < 0)
+    {
+        j->scroll = 0;
+    }
+}
+
+//绘制输出窗格：状态栏下方一行标题，其余各行显示输出，Tab展开，控制字符显示为'?'
+void draw_pane(struct buffer *ab)
+{
+    struct job *j = &G.job;
+    if (!j->visible)
+    {
+        return;
+    }
+    int top = G.screenrows + 1;
+    char state[32];
+    if (j->name == NULL)
+    {
+        snprintf(state, sizeof(state), "no job yet");
+    }
+    else if (j->pid > 0)
+    {
+        snprintf(state, sizeof(state), "running");
+    }
+    else if (WIFSIGNALED(j->status))
+    {
+        snprintf(state, sizeof(state), "killed by signal %d", WTERMSIG(j->status));
+    }
+    else
+    {
+        snprintf(state, sizeof(state), "exit %d", WEXITSTATUS(j->status));
+    }
+    char title[128];
+    int len = snprintf(title, sizeof(title), " %s: %s | Ctrl-K kill | Ctrl-U/Ctrl-D scroll | Ctrl-O hide",
+                       j->name ? j->name : "output", state);
+    if (len > G.screencols)
+    {
+        len = G.screencols;
+    }
+    screen_clear_line(top);
+    memset(&G.scr.back_attr[top * G.scr.cols], ATTR_INVERSE, G.scr.cols);
+    cells_put(top, 0, title, len, ATTR_INVERSE);
+    screen_flush_line(ab, top);
+
+    int h = j->rows - 1;
+    int last = job_lines() - j->scroll;
+    for (int y = 0; y < h; y++)
+    {
+        screen_clear_line(top + 1 + y);
+        int line = last - h + y;
+        if (line >= 0)
         {
-            if (c == PAGE_UP) 
-            {
-                G.cy = G.rowoff;
-            } 
-            else if (c == PAGE_DOWN) 
+            char *cells = &G.scr.back_ch[(top + 1 + y) * G.scr.cols];
+            int end = (line + 1 < j->nlines) ? j->lines[line + 1] - 1 : j->len;
+            int x = 0;
+            for (int i = j->lines[line]; i < end && x < G.screencols; i++)
             {
-                G.cy = G.rowoff + G.screenrows - 1;
-                if (G.cy > G.numrows)
+                unsigned char ch = j->out[i];
+                if (ch == '\t')
                 {
-                    G.cy = G.numrows;
+                    do
+                    {
+                        cells[x++] = ' ';
+                    } while (x % TAB_STOP != 0 && x < G.screencols);
+                }
+                else if (ch != '\r')
+                {
+                    cells[x++] = (ch < 32 || ch == 127) ? '?' : ch;
                 }
-            }
-            int times = G.screenrows;
-            while (times--)
-            {
-                move_cursor(c == PAGE_UP ? ARROW_UP : ARROW_DOWN);
             }
         }
-            break;
+        screen_flush_line(ab, top + 1 + y);
+    }
+}
 
-        case ARROW_UP:
-        case ARROW_DOWN:
-        case ARROW_LEFT:
-        case ARROW_RIGHT:
-            move_cursor(c);
-            break;
+/*-----------------------正则表达式---------------------------*/
 
-        case CTRL_KEY('l'):
-        case '\x1b':
-            break;
+//支持的语法：字符、'.'、[a-z]与[^...]字符类、\d \w \s、'\'转义、* + ?、'|'、括号分组
+//'^'只在开头、'$'只在结尾表示行首行尾，其他位置按普通字符处理
+//解析成语法树后编译成NFA，搜索时按需把NFA状态集合转成DFA状态并缓存，没有回溯
 
-        default:
-            editor_insert_char(c);
-            break;
+//语法树节点
+static int re_node(struct re_parser *ps, int type, int left, int right)
+{
+    if (ps->n == ps->cap)
+    {
+        ps->cap = ps->cap ? ps->cap * 2 : 32;
+        ps->nodes = realloc(ps->nodes, ps->cap * sizeof(struct re_node));
     }
-    quit_times = QUIT_TIMES;
+    struct re_node *nd = &ps->nodes[ps->n];
+    nd->type = type;
+    nd->left = left;
+    nd->right = right;
+    memset(nd->set, 0, sizeof(nd->set));
+    return ps->n++;
 }
 
-/*--------------------输出---------------------*/
+static void re_set_add(unsigned char *set, int c)
+{
+    set[c >> 3] |= 1 << (c & 7);
+}
 
-//翻卷
-void scroll() 
+static int re_set_has(const unsigned char *set, int c)
 {
-    G.rx = 0;
-    if (G.cy < G.numrows) 
+    return set[c >> 3] & (1 << (c & 7));
+}
+
+//\d \w \s 对应的字符类，不是这三个返回0
+static int re_class_escape(unsigned char *set, int c)
+{
+    if (c != 'd' && c != 'w' && c != 's')
+    {
+        return 0;
+    }
+    for (int i = 0; i < 256; i++)
     {
-        G.rx = cx_to_rx(&G.row[G.cy], G.cx);
+        if ((c == 'd' && isdigit(i)) || (c == 'w' && (isalnum(i) || i == '_')) || (c == 's' && isspace(i)))
+        {
+            re_set_add(set, i);
+        }
     }
+    return 1;
+}
 
-    if (G.cy < G.rowoff) 
+static int re_parse_alt(struct re_parser *ps);
+
+//解析[...]字符类，ps->p指向'['之后
+static int re_parse_class(struct re_parser *ps)
+{
+    int nd = re_node(ps, RE_N_SET, -1, -1);
+    unsigned char set[32] = {0};
+    int negate = 0;
+    if (*ps->p == '^')
     {
-        G.rowoff = G.cy;
+        negate = 1;
+        ps->p++;
     }
-    if (G.cy >= G.rowoff + G.screenrows) 
+    int first = 1;
+    while (*ps->p && (*ps->p != ']' || first))
     {
-        G.rowoff = G.cy - G.screenrows + 1;
+        int c = (unsigned char)*ps->p++;
+        first = 0;
+        if (c == '\\' && *ps->p)
+        {
+            c = (unsigned char)*ps->p++;
+            if (re_class_escape(set, c))
+            {
+                continue;
+            }
+        }
+        if (ps->p[0] == '-' && ps->p[1] && ps->p[1] != ']')
+        {
+            int hi = (unsigned char)ps->p[1];
+            ps->p += 2;
+            for (int i = c; i <= hi; i++)
+            {
+                re_set_add(set, i);
+            }
+        }
+        else
+        {
+            re_set_add(set, c);
+        }
     }
-    if (G.rx < G.coloff) 
+    if (*ps->p != ']')
     {
-        G.coloff = G.rx;
+        ps->error = 1;
+        return -1;
     }
-    if (G.rx >= G.coloff + G.screencols) 
+    ps->p++;
+    for (int i = 0; i < 32; i++)
     {
-        G.coloff = G.rx - G.screencols + 1;
+        ps->nodes[nd].set[i] = negate ? ~set[i] : set[i];
+    }
+    return nd;
+}
+
+//单个字符、字符类或括号分组
+static int re_parse_atom(struct re_parser *ps)
+{
+    int c = (unsigned char)*ps->p++;
+    if (c == '(')
+    {
+        int nd = re_parse_alt(ps);
+        if (nd < 0 || *ps->p != ')')
+        {
+            ps->error = 1;
+            return -1;
+        }
+        ps->p++;
+        return nd;
+    }
+    if (c == '[')
+    {
+        return re_parse_class(ps);
+    }
+    if (c == '*' || c == '+' || c == '?')
+    {
+        //没有可重复的内容
+        ps->error = 1;
+        return -1;
+    }
+
+    int nd = re_node(ps, RE_N_SET, -1, -1);
+    unsigned char *set = ps->nodes[nd].set;
+    if (c == '.')
+    {
+        memset(set, 0xff, 32);
+    }
+    else if (c == '\\')
+    {
+        if (*ps->p == '\0')
+        {
+            ps->error = 1;
+            return -1;
+        }
+        c = (unsigned char)*ps->p++;
+        if (!re_class_escape(set, c))
+        {
+            re_set_add(set, c);
+        }
     }
+    else
+    {
+        re_set_add(set, c);
+    }
+    return nd;
 }
 
+//原子加上后缀的* + ?
+static int re_parse_repeat(struct re_parser *ps)
+{
+    int nd = re_parse_atom(ps);
+    while (nd >= 0 && (*ps->p == '*' || *ps->p == '+' || *ps->p == '?'))
+    {
+        int c = *ps->p++;
+        nd = re_node(ps, (c == '*') ? RE_N_STAR : (c == '+') ? RE_N_PLUS : RE_N_QUEST, nd, -1);
+    }
+    return nd;
+}
 
-//像vim一样画波浪线,语法高亮，并显示版本信息
-void draw_rows(struct buffer *ab) 
+//连接，遇到'|'、')'或结尾时停止
+static int re_parse_cat(struct re_parser *ps)
 {
-    int y;
-    for (y = 0; y < G.screenrows; y++) 
+    int nd = re_node(ps, RE_N_EMPTY, -1, -1);
+    while (*ps->p && *ps->p != '|' && *ps->p != ')' && !(ps->p == ps->end && ps->eol))
     {
-        int filerow = y + G.rowoff;
-        if (filerow >= G.numrows) 
+        int next = re_parse_repeat(ps);
+        if (next < 0)
         {
-            //1/3处显示信息
-            if (G.numrows == 0 && y == G.screenrows / 3) 
-            {
-                char welcome[80];
-                int welcomelen = snprintf(welcome, sizeof(welcome),"CV editor -- version %s", VERSION);
-                if (welcomelen > G.screencols)
-                {
-                    welcomelen = G.screencols;
-                }
-                //居中显示
-                int padding = (G.screencols - welcomelen) / 2;
-                if (padding) 
-                {
-                    buf_append(ab, "~", 1);
-                    padding--;
-                }
-                while (padding--)
-                {
-                    buf_append(ab, " ", 1);
-                }
-                buf_append(ab, welcome, welcomelen);
-            } 
-            else 
-            {
-                buf_append(ab, "~", 1);
-            }
-        } 
-        else 
+            return -1;
+        }
+        nd = re_node(ps, RE_N_CAT, nd, next);
+    }
+    return nd;
+}
+
+//选择
+static int re_parse_alt(struct re_parser *ps)
+{
+    int nd = re_parse_cat(ps);
+    while (nd >= 0 && *ps->p == '|')
+    {
+        ps->p++;
+        int right = re_parse_cat(ps);
+        if (right < 0)
         {
-            int len = G.row[filerow].rsize - G.coloff;
-            if (len < 0)
-            {
-                len = 0;
-            }
-            if (len > G.screencols)
-            {
-                len = G.screencols;
-            }
-            char *c = &G.row[filerow].render[G.coloff];
-            unsigned char *hl = &G.row[filerow].hl[G.coloff];
-            int current_color = -1;
-            int j;
-            //加转义字符高亮
-            for (j = 0; j < len; j++) 
+            return -1;
+        }
+        nd = re_node(ps, RE_N_ALT, nd, right);
+    }
+    return nd;
+}
+
+//新建一个NFA状态
+static int re_state(struct re_prog *pg, int type, int out, int out1)
+{
+    if (pg->n == pg->cap)
+    {
+        pg->cap = pg->cap ? pg->cap * 2 : 32;
+        pg->st = realloc(pg->st, pg->cap * sizeof(struct re_state));
+    }
+    struct re_state *st = &pg->st[pg->n];
+    st->type = type;
+    st->out = out;
+    st->out1 = out1;
+    memset(st->set, 0, sizeof(st->set));
+    return pg->n++;
+}
+
+//把语法树节点编译成NFA片段，片段走完后接到next，返回入口状态；rev为1时编译成倒着读的表达式
+static int re_compile(struct re_prog *pg, struct re_node *nodes, int nd, int next, int rev)
+{
+    struct re_node *n = &nodes[nd];
+    int s;
+    switch (n->type)
+    {
+        case RE_N_SET:
+            s = re_state(pg, RE_CHAR, next, -1);
+            memcpy(pg->st[s].set, n->set, 32);
+            return s;
+        case RE_N_CAT:
+            if (rev)
             {
-                if (iscntrl(c[j])) 
-                {
-                    char sym = (c[j] <= 26) ? '@' + c[j] : '?';
-                    buf_append(ab, "\x1b[7m", 4);
-                    buf_append(ab, &sym, 1);
-                    buf_append(ab, "\x1b[m", 3);
-                    if (current_color != -1) 
-                    {
-                        char buf[16];
-                        int clen = snprintf(buf, sizeof(buf), "\x1b[%dm", current_color);
-                        buf_append(ab, buf, clen);
-                    }
-                } 
-                else if (hl[j] == HL_NORMAL) 
-                {
-                    if (current_color != -1) 
-                    {
-                        buf_append(ab, "\x1b[39m", 5);
-                        current_color = -1;
-                    }
-                    buf_append(ab, &c[j], 1);
-                } 
-                else 
-                {
-                    int color = syntax_color(hl[j]);
-                    if (color != current_color) 
-                    {
-                        current_color = color;
-                        char buf[16];
-                        int clen = snprintf(buf, sizeof(buf), "\x1b[%dm", color);
-                        buf_append(ab, buf, clen);
-                    }
-                    buf_append(ab, &c[j], 1);
-                }
+                return re_compile(pg, nodes, n->right, re_compile(pg, nodes, n->left, next, rev), rev);
             }
-            buf_append(ab, "\x1b[39m", 5);
+            return re_compile(pg, nodes, n->left, re_compile(pg, nodes, n->right, next, rev), rev);
+        case RE_N_ALT:
+        {
+            int a = re_compile(pg, nodes, n->left, next, rev);
+            int b = re_compile(pg, nodes, n->right, next, rev);
+            return re_state(pg, RE_SPLIT, a, b);
+        }
+        case RE_N_QUEST:
+            return re_state(pg, RE_SPLIT, re_compile(pg, nodes, n->left, next, rev), next);
+        case RE_N_STAR:
+        case RE_N_PLUS:
+        {
+            //编译循环体时状态数组可能扩容搬走，先取得入口再写回
+            s = re_state(pg, RE_SPLIT, -1, next);
+            int body = re_compile(pg, nodes, n->left, s, rev);
+            pg->st[s].out = body;
+            return (n->type == RE_N_STAR) ? s : body;
         }
-        buf_append(ab, "\x1b[K", 3);
-        buf_append(ab, "\r\n", 2);
+        default:
+            return next;
     }
 }
 
+//从状态s出发沿SPLIT能到达的字符状态和接受状态加入集合，mark避免重复
+static void re_closure(struct re_dfa *d, int s, int *set, int *n)
+{
+    struct re_prog *pg = d->prog;
+    int sp = 0;
+    d->stack[sp++] = s;
+    while (sp > 0)
+    {
+        s = d->stack[--sp];
+        if (d->mark[s] == d->mark_gen)
+        {
+            continue;
+        }
+        d->mark[s] = d->mark_gen;
+        if (pg->st[s].type == RE_SPLIT)
+        {
+            d->stack[sp++] = pg->st[s].out1;
+            d->stack[sp++] = pg->st[s].out;
+        }
+        else
+        {
+            set[(*n)++] = s;
+        }
+    }
+}
 
-
-//清屏，显示状态栏，并将光标移动到原先位置
-void refresh_screen() 
+static int re_int_cmp(const void *a, const void *b)
 {
-    scroll();
+    return *(const int *)a - *(const int *)b;
+}
 
-    struct buffer ab = BUF_INIT;
+static unsigned int re_set_hash(const int *set, int n)
+{
+    unsigned int h = 2166136261u;
+    for (int i = 0; i < n; i++)
+    {
+        h = (h ^ set[i]) * 16777619u;
+    }
+    return h;
+}
 
-    buf_append(&ab, "\x1b[?25l", 6);
-    buf_append(&ab, "\x1b[H", 3);
+static int re_dfa_add(struct re_dfa *d, const int *set, int n);
 
-    draw_rows(&ab);
-    draw_status_bar(&ab);
-    draw_message_bar(&ab);
+//状态数组用满时扩大一倍，散列表保持为状态数的两倍，按各状态的集合重新放入
+static void re_dfa_grow(struct re_dfa *d)
+{
+    d->cap = d->cap ? d->cap * 2 : 16;
+    d->next = realloc(d->next, d->cap * 256 * sizeof(int));
+    d->set_start = realloc(d->set_start, d->cap * sizeof(int));
+    d->set_len = realloc(d->set_len, d->cap * sizeof(int));
+    d->accept = realloc(d->accept, d->cap);
+    d->hash_cap = d->cap * 2;
+    d->hash = realloc(d->hash, d->hash_cap * sizeof(int));
+    memset(d->hash, -1, d->hash_cap * sizeof(int));
+    for (int id = 0; id < d->nstates; id++)
+    {
+        unsigned int h = re_set_hash(&d->pool[d->set_start[id]], d->set_len[id]) & (d->hash_cap - 1);
+        while (d->hash[h] != -1)
+        {
+            h = (h + 1) & (d->hash_cap - 1);
+        }
+        d->hash[h] = id;
+    }
+}
 
-    char buf[32];
-    snprintf(buf, sizeof(buf), "\x1b[%d;%dH", (G.cy - G.rowoff) + 1, (G.rx - G.coloff) + 1);
-    buf_append(&ab, buf, strlen(buf));
+//把scratch[from, *n)作为一组排序；非锚定时在组后加分隔，返回这组里有没有接受状态
+static int re_dfa_group(struct re_dfa *d, int from, int *n)
+{
+    if (*n == from)
+    {
+        return 0;
+    }
+    qsort(&d->scratch[from], *n - from, sizeof(int), re_int_cmp);
+    if (!d->unanchored)
+    {
+        return 0;
+    }
+    int match = 0;
+    for (int i = from; i < *n; i++)
+    {
+        if (d->prog->st[d->scratch[i]].type == RE_MATCH)
+        {
+            match = 1;
+        }
+    }
+    d->scratch[(*n)++] = RE_GROUP;
+    return match;
+}
 
-    buf_append(&ab, "\x1b[?25h", 6);
+//集合set读入字符c后的NFA状态集合写入scratch，返回长度；set为空、c为-1时求起始状态
+//非锚定时逐组推进，前面的组已有的NFA状态后面的组不再重复加入；某组匹配后丢掉之后的组并记下已匹配
+static int re_dfa_next(struct re_dfa *d, const int *set, int len, int c)
+{
+    struct re_prog *pg = d->prog;
+    int matched = (len > 0 && set[0] == RE_MATCHED);
+    int n = 0;
+    d->mark_gen++;
+    int i = matched;
+    while (i < len)
+    {
+        int from = n;
+        for (; i < len && set[i] != RE_GROUP; i++)
+        {
+            struct re_state *st = &pg->st[set[i]];
+            if (st->type == RE_CHAR && re_set_has(st->set, c))
+            {
+                re_closure(d, st->out, d->scratch, &n);
+            }
+        }
+        i++;
+        if (re_dfa_group(d, from, &n))
+        {
+            matched = 1;
+            break;
+        }
+    }
+    if (c < 0 || (d->unanchored && !matched))
+    {
+        int from = n;
+        re_closure(d, pg->start, d->scratch, &n);
+        matched |= re_dfa_group(d, from, &n);
+    }
+    if (d->unanchored && matched)
+    {
+        //所有的组都走不下去时是死状态
+        if (n == 0)
+        {
+            return 0;
+        }
+        memmove(&d->scratch[1], d->scratch, n * sizeof(int));
+        d->scratch[0] = RE_MATCHED;
+        n++;
+    }
+    return n;
+}
 
-    write(STDOUT_FILENO, ab.b, ab.len);
-    buf_free(&ab);
+//清空DFA缓存，只留下起始状态
+static void re_dfa_clear(struct re_dfa *d)
+{
+    d->nstates = 0;
+    d->pool_len = 0;
+    memset(d->hash, -1, d->hash_cap * sizeof(int));
+    int n = re_dfa_next(d, NULL, 0, -1);
+    d->start = re_dfa_add(d, d->scratch, n);
 }
 
-//绘制状态栏
-void draw_status_bar(struct buffer *ab) 
+//查找NFA状态集合对应的DFA状态，没有则新建
+static int re_dfa_add(struct re_dfa *d, const int *set, int n)
 {
-    buf_append(ab, "\x1b[7m", 4);
-    char status[80], rstatus[80];
-    int len = snprintf(status, sizeof(status), "%.20s - %d lines %s",
-        G.filename ? G.filename : "[No Name]", G.numrows,
-        G.dirty ? "(modified)" : "");
-    int rlen = snprintf(rstatus, sizeof(rstatus), "%s | %d/%d",
-        G.syntax ? G.syntax->filetype : "no ft", G.cy + 1, G.numrows);
-    if (len > G.screencols)
+    if (d->nstates == d->cap)
     {
-        len = G.screencols;
+        re_dfa_grow(d);
+    }
+    unsigned int h = re_set_hash(set, n) & (d->hash_cap - 1);
+    while (d->hash[h] != -1)
+    {
+        int id = d->hash[h];
+        if (d->set_len[id] == n && !memcmp(&d->pool[d->set_start[id]], set, n * sizeof(int)))
+        {
+            return id;
+        }
+        h = (h + 1) & (d->hash_cap - 1);
+    }
+
+    int id = d->nstates++;
+    d->hash[h] = id;
+    if (d->pool_len + n > d->pool_cap)
+    {
+        d->pool_cap = (d->pool_len + n) * 2;
+        d->pool = realloc(d->pool, d->pool_cap * sizeof(int));
     }
-    buf_append(ab, status, len);
-    while (len < G.screencols) 
+    memcpy(&d->pool[d->pool_len], set, n * sizeof(int));
+    d->set_start[id] = d->pool_len;
+    d->set_len[id] = n;
+    d->pool_len += n;
+    d->accept[id] = 0;
+    for (int i = 0; i < n; i++)
     {
-        if (G.screencols - len == rlen) 
+        if (set[i] >= 0 && d->prog->st[set[i]].type == RE_MATCH)
         {
-            buf_append(ab, rstatus, rlen);
-            break;
-        } 
-        else 
-        {
-            buf_append(ab, " ", 1);
-            len++;
+            d->accept[id] = 1;
         }
     }
-    buf_append(ab, "\x1b[m", 3);
-    buf_append(ab, "\r\n", 2);
+    memset(&d->next[id * 256], -1, 256 * sizeof(int));
+    return id;
 }
 
-//显示提示函数
-char *editor_prompt(char *prompt, void (*callback)(char *, int)) 
+//第一次走某条转移时计算目标状态；缓存满时清空重来，返回的编号在新缓存里仍然有效
+static int re_dfa_step(struct re_dfa *d, int id, int c)
 {
-    size_t bufsize = 128;
-    char *buf = malloc(bufsize);
-
-    size_t buflen = 0;
-    buf[0] = '\0';
+    int next = d->next[id * 256 + c];
+    if (next >= 0)
+    {
+        return next;
+    }
 
-    while (1) 
+    int n = re_dfa_next(d, &d->pool[d->set_start[id]], d->set_len[id], c);
+    if (d->nstates == RE_DFA_MAX)
     {
-        set_status_message(prompt, buf);
-        refresh_screen();
+        //scratch在清空时会被起始状态用掉，先挪开
+        int *set = malloc((n + 1) * sizeof(int));
+        memcpy(set, d->scratch, n * sizeof(int));
+        re_dfa_clear(d);
+        next = re_dfa_add(d, set, n);
+        free(set);
+        return next;
+    }
+    next = re_dfa_add(d, d->scratch, n);
+    d->next[id * 256 + c] = next;
+    return next;
+}
 
-        int c = read_key();
-        if (c == DEL_KEY || c == CTRL_KEY('h') || c == BACKSPACE) 
-        {
-            if (buflen != 0)
-            {
-                buf[--buflen] = '\0';
-            }
-        } 
-        else if (c == '\x1b') 
-        {
-            set_status_message("");
-            if (callback)
-            {
-                callback(buf, c);
-            }
-            free(buf);
-            return NULL;
-        } 
-        else if (c == '\r') 
-        {
-            if (buflen != 0) 
-            {
-                set_status_message("");
-                if (callback)
-                {
-                    callback(buf, c);
-                }
-                return buf;
-            }
-        } 
-        else if (!iscntrl(c) && c < 128) 
+//转移表随状态增加按需扩大，刚建好时只有十几个状态的空间
+static void re_dfa_init(struct re_dfa *d, struct re_prog *pg, int unanchored)
+{
+    d->prog = pg;
+    d->unanchored = unanchored;
+    d->nstates = d->cap = 0;
+    d->next = NULL;
+    d->set_start = NULL;
+    d->set_len = NULL;
+    d->accept = NULL;
+    d->hash = NULL;
+    d->pool = NULL;
+    d->pool_cap = 0;
+    re_dfa_grow(d);
+    d->mark = calloc(pg->n, sizeof(unsigned int));
+    d->mark_gen = 0;
+    d->stack = malloc(2 * pg->n * sizeof(int) + sizeof(int));
+    //非锚定时每个NFA状态最多出现一次，每组后一个分隔，开头一个已匹配标记
+    d->scratch = malloc(2 * pg->n * sizeof(int) + 2 * sizeof(int));
+    re_dfa_clear(d);
+
+    //非锚定搜索停在起始状态时，只有一个字节能离开的话可以用memchr跳过
+    d->skip = -1;
+    if (unanchored && !d->accept[d->start])
+    {
+        int only = -1;
+        for (int c = 0; c < 256 && only != -2; c++)
         {
-            if (buflen == bufsize - 1) 
+            if (re_dfa_step(d, d->start, c) != d->start)
             {
-                bufsize *= 2;
-                buf = realloc(buf, bufsize);
+                only = (only == -1) ? c : -2;
             }
-            buf[buflen++] = c;
-            buf[buflen] = '\0';
-        }
-        if (callback)
-        {
-            callback(buf, c);
         }
+        d->skip = (only >= 0) ? only : -1;
     }
 }
 
-
-//设置状态栏
-void set_status_message(const char *fmt, ...) 
+static void re_dfa_free(struct re_dfa *d)
 {
-    va_list ap;
-    va_start(ap, fmt);
-    vsnprintf(G.statusmsg, sizeof(G.statusmsg), fmt, ap);
-    va_end(ap);
-    G.statusmsg_time = time(NULL);
+    free(d->next);
+    free(d->set_start);
+    free(d->set_len);
+    free(d->accept);
+    free(d->pool);
+    free(d->hash);
+    free(d->mark);
+    free(d->stack);
+    free(d->scratch);
 }
 
-void draw_message_bar(struct buffer *ab) 
+//两段字面文本连起来
+static struct re_lit re_lit_cat(struct re_lit a, struct re_lit b)
 {
-    buf_append(ab, "\x1b[K", 3);
-    int msglen = strlen(G.statusmsg);
-    if (msglen > G.screencols)
+    struct re_lit r;
+    r.len = a.len + b.len;
+    r.s = malloc(r.len + 1);
+    if (a.len > 0)
     {
-        msglen = G.screencols;
+        memcpy(r.s, a.s, a.len);
     }
-    if (msglen && time(NULL) - G.statusmsg_time < 5)
+    if (b.len > 0)
     {
-        buf_append(ab, G.statusmsg, msglen);
+        memcpy(&r.s[a.len], b.s, b.len);
     }
+    return r;
 }
 
+static struct re_lit re_lit_copy(struct re_lit a)
+{
+    struct re_lit empty = {NULL, 0};
+    return re_lit_cat(a, empty);
+}
 
+static void re_lit_free(struct re_info *in)
+{
+    free(in->prefix.s);
+    free(in->suffix.s);
+    free(in->must.s);
+    free(in->str.s);
+}
 
-/*-----------------------文件操作--------------------------*/
+//分析语法树节点匹配的串：必定以prefix开头、以suffix结尾、包含must；exact表示只能匹配str这一个串
+static struct re_info re_analyze(struct re_node *nodes, int nd)
+{
+    struct re_node *n = &nodes[nd];
+    struct re_lit empty = {NULL, 0};
+    struct re_info r = {empty, empty, empty, empty, 0};
 
-//为了处理Tab这种一个符号占多个字符的情况，需建立字符索引和符号索引并相互转换
-int cx_to_rx(erow *row, int cx) 
+    if (n->type == RE_N_EMPTY)
+    {
+        r.exact = 1;
+        return r;
+    }
+    if (n->type == RE_N_SET)
+    {
+        int only = -1;
+        for (int c = 0; c < 256 && only != -2; c++)
+        {
+            if (re_set_has(n->set, c))
+            {
+                only = (only == -1) ? c : -2;
+            }
+        }
+        if (only >= 0)
+        {
+            char ch = only;
+            struct re_lit one = {&ch, 1};
+            r.exact = 1;
+            r.str = re_lit_copy(one);
+            r.prefix = re_lit_copy(one);
+            r.suffix = re_lit_copy(one);
+            r.must = re_lit_copy(one);
+        }
+        return r;
+    }
+    if (n->type == RE_N_CAT)
+    {
+        struct re_info a = re_analyze(nodes, n->left);
+        struct re_info b = re_analyze(nodes, n->right);
+        r.exact = a.exact && b.exact;
+        if (r.exact)
+        {
+            r.str = re_lit_cat(a.str, b.str);
+        }
+        r.prefix = a.exact ? re_lit_cat(a.str, b.prefix) : re_lit_copy(a.prefix);
+        r.suffix = b.exact ? re_lit_cat(a.suffix, b.str) : re_lit_copy(b.suffix);
+        //跨过两段交界的一段，和两段各自必含的文本，取最长的
+        r.must = re_lit_cat(a.suffix, b.prefix);
+        struct re_lit *longer = (a.must.len >= b.must.len) ? &a.must : &b.must;
+        if (longer->len > r.must.len)
+        {
+            free(r.must.s);
+            r.must = re_lit_copy(*longer);
+        }
+        re_lit_free(&a);
+        re_lit_free(&b);
+        return r;
+    }
+    if (n->type == RE_N_PLUS)
+    {
+        //至少出现一次，首尾和必含文本与子节点相同
+        struct re_info a = re_analyze(nodes, n->left);
+        r.prefix = re_lit_copy(a.prefix);
+        r.suffix = re_lit_copy(a.suffix);
+        r.must = re_lit_copy(a.must);
+        re_lit_free(&a);
+        return r;
+    }
+    return r;
+}
+
+//编译正则表达式，语法错误返回NULL
+struct regex *re_compile_pattern(const char *pattern)
 {
-    int rx = 0;
-    int j;
-    for (j = 0; j < cx; j++) 
+    struct re_parser ps = {0};
+    int len = strlen(pattern);
+    int bol = (len > 0 && pattern[0] == '^');
+    //结尾的'$'没有被转义时表示行尾
+    int eol = 0;
+    if (len > bol && pattern[len - 1] == '$')
     {
-        if (row->chars[j] == '\t')
+        int slashes = 0;
+        for (int i = len - 2; i >= bol && pattern[i] == '\\'; i--)
         {
-            rx += (TAB_STOP - 1) - (rx % TAB_STOP);
+            slashes++;
         }
-        rx++;
+        eol = (slashes % 2 == 0);
+    }
+    ps.p = pattern + bol;
+    ps.end = pattern + len - eol;
+    ps.eol = eol;
+    int root = re_parse_alt(&ps);
+    if (root < 0 || ps.error || ps.p != ps.end)
+    {
+        free(ps.nodes);
+        return NULL;
+    }
+
+    struct regex *re = malloc(sizeof(struct regex));
+    re->bol = bol;
+    re->eol = eol;
+    memset(&re->prog, 0, sizeof(re->prog));
+    re->prog.start = re_compile(&re->prog, ps.nodes, root, re_state(&re->prog, RE_MATCH, -1, -1), 0);
+    memset(&re->rprog, 0, sizeof(re->rprog));
+    re->rprog.start = re_compile(&re->rprog, ps.nodes, root, re_state(&re->rprog, RE_MATCH, -1, -1), 1);
+
+    struct re_info info = re_analyze(ps.nodes, root);
+    re->must = info.must;
+    info.must.s = NULL;
+    re_lit_free(&info);
+    free(ps.nodes);
+
+    re_dfa_init(&re->search, &re->prog, 1);
+    re_dfa_init(&re->longest, &re->prog, 0);
+    re_dfa_init(&re->reverse, &re->rprog, 0);
+    return re;
+}
+
+void re_free(struct regex *re)
+{
+    if (re == NULL)
+    {
+        return;
     }
-    return rx;
+    re_dfa_free(&re->search);
+    re_dfa_free(&re->longest);
+    re_dfa_free(&re->reverse);
+    free(re->prog.st);
+    free(re->rprog.st);
+    free(re->must.s);
+    free(re);
 }
 
-int rx_to_cx(erow *row, int rx) 
+//从start开始锚定匹配，返回最长匹配的结束位置，不匹配返回-1
+static long re_longest(struct regex *re, const char *s, long len, long start)
 {
-    int cur_rx = 0;
-    int cx;
-    for (cx = 0; cx < row->size; cx++) 
+    struct re_dfa *d = &re->longest;
+    int id = d->start;
+    long end = (d->accept[id] && (!re->eol || start == len)) ? start : -1;
+    for (long i = start; i < len; i++)
     {
-        if (row->chars[cx] == '\t')
+        int next = d->next[id * 256 + (unsigned char)s[i]];
+        id = (next >= 0) ? next : re_dfa_step(d, id, (unsigned char)s[i]);
+        if (d->set_len[id] == 0)
         {
-            cur_rx += (TAB_STOP - 1) - (cur_rx % TAB_STOP);
+            break;
         }
-        cur_rx++;
-        if (cur_rx > rx)
+        if (d->accept[id] && (!re->eol || i + 1 == len))
         {
-            return cx;
+            end = i + 1;
         }
     }
-    return cx;
+    return end;
 }
 
-
-//更新行
-void update_row(erow *row) 
+//从end往回锚定匹配反转的表达式，不早于from，返回最早的起点，不匹配返回-1
+static long re_earliest(struct regex *re, const char *s, long from, long end)
 {
-    int tabs = 0;
-    int j;
-    for (j = 0; j < row->size; j++)
+    struct re_dfa *d = &re->reverse;
+    int id = d->start;
+    long start = d->accept[id] ? end : -1;
+    for (long i = end - 1; i >= from; i--)
     {
-        if (row->chars[j] == '\t')
+        int next = d->next[id * 256 + (unsigned char)s[i]];
+        id = (next >= 0) ? next : re_dfa_step(d, id, (unsigned char)s[i]);
+        if (d->set_len[id] == 0)
         {
-            tabs++;
+            break;
+        }
+        if (d->accept[id])
+        {
+            start = i;
         }
     }
+    return start;
+}
 
-    free(row->render);
-    row->render = malloc(row->size + tabs*(TAB_STOP - 1) + 1);
+//在s[from, len)中查找最左最长的匹配，返回起点并把长度写入*mlen，没有返回-1；每种情况都只线性扫描一两遍
+//以'^'开头时只能从行首锚定匹配；以'$'结尾时结尾固定在行尾，从行尾往回找最早的起点；
+//其他情况先用非锚定的DFA找到最左最长匹配的结尾，再从结尾往回找到它的起点
+long re_search(struct regex *re, const char *s, long len, long from, long *mlen)
+{
+    if (re->bol && from > 0)
+    {
+        return -1;
+    }
+    //先用向量化的memmem排除不含必有文本的部分
+    if (re->must.len > 0 && memmem(&s[from], len - from, re->must.s, re->must.len) == NULL)
+    {
+        return -1;
+    }
 
-    int idx = 0;
-    for (j = 0; j < row->size; j++) 
+    long start = from;
+    long end;
+    if (re->bol)
     {
-        if (row->chars[j] == '\t') 
+        end = re_longest(re, s, len, from);
+    }
+    else if (re->eol)
+    {
+        end = len;
+        start = re_earliest(re, s, from, end);
+    }
+    else
+    {
+        struct re_dfa *d = &re->search;
+        int id = d->start;
+        end = d->accept[id] ? from : -1;
+        for (long i = from; i < len; i++)
         {
-            row->render[idx++] = ' ';
-            while (idx % TAB_STOP != 0)
+            if (id == d->start && d->skip >= 0)
             {
-                row->render[idx++] = ' ';
+                const char *p = memchr(&s[i], d->skip, len - i);
+                if (p == NULL)
+                {
+                    break;
+                }
+                i = p - s;
             }
-        } 
-        else 
+            int next = d->next[id * 256 + (unsigned char)s[i]];
+            id = (next >= 0) ? next : re_dfa_step(d, id, (unsigned char)s[i]);
+            if (d->set_len[id] == 0)
+            {
+                break;
+            }
+            if (d->accept[id])
+            {
+                end = i + 1;
+            }
+        }
+        if (end >= 0)
         {
-            row->render[idx++] = row->chars[j];
+            start = re_earliest(re, s, from, end);
         }
     }
-    row->render[idx] = '\0';
-    row->rsize = idx;
-
-    update_syntax(row);
+    if (end < 0 || start < 0)
+    {
+        return -1;
+    }
+    *mlen = end - start;
+    return start;
 }
 
-//插入字符
-void row_insert_char(erow *row, int at, int c) 
+/*-----------------------搜索---------------------------*/
+
+//按字面或按正则表达式查找的匹配器；正则模式下没有特殊字符的查询仍按字面查找
+struct matcher *matcher_new(const char *pattern, int regex)
 {
-    if (at < 0 || at > row->size)
+    struct matcher *m = malloc(sizeof(struct matcher));
+    m->pattern = strdup(pattern);
+    m->len = strlen(pattern);
+    m->re = NULL;
+    m->bad = 0;
+    if (regex && strpbrk(pattern, ".[]()*+?|\\^$") != NULL)
     {
-        at = row->size;
+        m->re = re_compile_pattern(pattern);
+        m->bad = (m->re == NULL);
     }
-    row->chars = realloc(row->chars, row->size + 2);
-    memmove(&row->chars[at + 1], &row->chars[at], row->size - at + 1);
-    row->size++;
-    row->chars[at] = c;
-    update_row(row);
-    G.dirty++;
+    return m;
 }
 
+void matcher_free(struct matcher *m)
+{
+    if (m == NULL)
+    {
+        return;
+    }
+    re_free(m->re);
+    free(m->pattern);
+    free(m);
+}
 
-//Enter键插入新行
-void insert_new_line() 
+//在s[from, len)中查找，返回匹配起点并把长度写入*mlen，没有返回-1
+long matcher_find(struct matcher *m, const char *s, long len, long from, long *mlen)
 {
-    if (G.cx == 0) 
+    if (m->bad)
     {
-        editor_insert_row(G.cy, "", 0);
-    } 
-    else 
+        return -1;
+    }
+    if (m->re)
     {
-        erow *row = &G.row[G.cy];
-        editor_insert_row(G.cy + 1, &row->chars[G.cx], row->size - G.cx);
-        row = &G.row[G.cy];
-        row->size = G.cx;
-        row->chars[row->size] = '\0';
-        update_row(row);
+        return re_search(m->re, s, len, from, mlen);
     }
-    G.cy++;
-    G.cx = 0;
+    char *p = memmem(&s[from], len - from, m->pattern, m->len);
+    *mlen = m->len;
+    return p ? p - s : -1;
 }
 
-void row_append_string(erow *row, char *s, size_t len) 
+//释放一级搜索结果
+static void search_level_free(struct search_level *lv)
 {
-    row->chars = realloc(row->chars, row->size + len + 1);
-    memcpy(&row->chars[row->size], s, len);
-    row->size += len;
-    row->chars[row->size] = '\0';
-    update_row(row);
-    G.dirty++;
+    for (int c = 0; lv->chunks && c < lv->nchunks; c++)
+    {
+        free(lv->chunks[c].rows);
+    }
+    free(lv->chunks);
+    lv->chunks = NULL;
 }
 
+//清空搜索结果缓存，文本变化后行号和内容都可能变了
+void search_reset()
+{
+    struct search *sr = &G.search;
+    while (sr->nlevels > 0)
+    {
+        search_level_free(&sr->levels[--sr->nlevels]);
+    }
+    free(sr->query);
+    sr->query = NULL;
+    matcher_free(sr->m);
+    sr->m = NULL;
 
+    G.match.nblocks = 0;
+    G.match.total = 0;
+}
 
-//实现退格各种功能
-void row_del_char(erow *row, int at) 
+//一行中有几处不重叠的匹配，空匹配不算
+long row_count(erow *row, struct matcher *m)
 {
-    if (at < 0 || at >= row->size)
+    long n = 0;
+    long at = 0;
+    long mlen;
+    while (at < row->size && (at = matcher_find(m, row->chars, row->size, at, &mlen)) >= 0)
     {
-        return;
+        if (mlen > 0)
+        {
+            n++;
+        }
+        at += mlen ? mlen : 1;
     }
-    memmove(&row->chars[at], &row->chars[at + 1], row->size - at);
-    row->size--;
-    update_row(row);
-    G.dirty++;
+    return n;
 }
 
-
-//删除行
-void free_row(erow *row) 
+//开始统计query的匹配数，NULL表示结束搜索；查询和模式不变时保留已统计的部分
+void match_set_query(const char *query, int regex)
 {
-    free(row->render);
-    free(row->chars);
-    free(row->hl);
+    struct match_count *m = &G.match;
+    if (query && m->query && !strcmp(query, m->query) && regex == m->regex)
+    {
+        return;
+    }
+    free(m->query);
+    matcher_free(m->m);
+    m->query = query ? strdup(query) : NULL;
+    m->m = query ? matcher_new(query, regex) : NULL;
+    m->regex = regex;
+    m->row = -1;
+    m->nblocks = 0;
+    m->total = 0;
 }
 
-//行首退格删除行
-void editor_del_row(int at) 
+//当前匹配是第几个，所在块还没统计到时返回0
+long match_index()
 {
-    if (at < 0 || at >= G.numrows)
+    struct match_count *m = &G.match;
+    int b = m->row / COUNT_BLOCK;
+    if (m->row < 0 || b >= m->nblocks)
     {
-        return;
+        return 0;
     }
-    free_row(&G.row[at]);
-    memmove(&G.row[at], &G.row[at + 1], sizeof(erow) * (G.numrows - at - 1));
-    for (int j = at; j < G.numrows - 1; j++)
+    long k = 1;
+    for (int i = 0; i < b; i++)
     {
-        G.row[j].idx--;
+        k += m->blocks[i];
     }
-    G.numrows--;
-    G.dirty++;
+    for (int i = b * COUNT_BLOCK; i < m->row; i++)
+    {
+        k += row_count(row_at(i), m->m);
+    }
+    return k;
 }
 
-//行首退格将本行字符串附加到上一行行尾
-void editor_insert_row(int at, char *s, size_t len) 
+//在chars中查找，返回第一处匹配的字符索引，没有返回-1
+long row_find(erow *row, struct matcher *m)
 {
-    if (at < 0 || at > G.numrows)
+    long mlen;
+    return matcher_find(m, row->chars, row->size, 0, &mlen);
+}
+
+//取得query对应的一级搜索结果：复用最长的前缀级，查找时只在它匹配到的行里筛选
+//正则表达式加长后匹配的行不一定变少，只复用完全相同的查询
+static struct search_level *search_level_for(const char *query)
+{
+    struct search *sr = &G.search;
+    int qlen = strlen(query);
+
+    //丢掉查询已不再是当前查询前缀的级
+    while (sr->nlevels > 0)
     {
-        return;
+        struct search_level *top = &sr->levels[sr->nlevels - 1];
+        if (top->qlen <= qlen && !memcmp(sr->query, query, top->qlen) && (!sr->regex || top->qlen == qlen))
+        {
+            break;
+        }
+        search_level_free(top);
+        sr->nlevels--;
     }
-
-    G.row = realloc(G.row, sizeof(erow) * (G.numrows + 1));
-    memmove(&G.row[at + 1], &G.row[at], sizeof(erow) * (G.numrows - at));
-    for (int j = at + 1; j <= G.numrows; j++)
+    if (sr->query == NULL || strcmp(sr->query, query))
     {
-        G.row[j].idx++;
+        free(sr->query);
+        sr->query = strdup(query);
+        matcher_free(sr->m);
+        sr->m = matcher_new(query, sr->regex);
     }
 
-    G.row[at].idx = at;
-
-    G.row[at].size = len;
-    G.row[at].chars = malloc(len + 1);
-    memcpy(G.row[at].chars, s, len);
-    G.row[at].chars[len] = '\0';
-
-    G.row[at].rsize = 0;
-    G.row[at].render = NULL;
-    G.row[at].hl = NULL;
-    G.row[at].hl_open_comment = 0;
-    update_row(&G.row[at]);
+    struct search_level *base = sr->nlevels ? &sr->levels[sr->nlevels - 1] : NULL;
+    if (base && base->qlen == qlen)
+    {
+        return base;
+    }
 
-    G.numrows++;
-    G.dirty++;
+    if (sr->nlevels == sr->cap)
+    {
+        sr->cap = sr->cap ? sr->cap * 2 : 8;
+        sr->levels = realloc(sr->levels, sr->cap * sizeof(struct search_level));
+    }
+    struct search_level *lv = &sr->levels[sr->nlevels++];
+    lv->qlen = qlen;
+    lv->chunks = NULL;
+    lv->nchunks = 0;
+    if (qlen > 0)
+    {
+        //各块都还没查，用到哪块查哪块
+        lv->nchunks = (G.numrows + SEARCH_CHUNK_ROWS - 1) / SEARCH_CHUNK_ROWS;
+        lv->chunks = calloc(lv->nchunks ? lv->nchunks : 1, sizeof(struct search_chunk));
+    }
+    return lv;
 }
 
-//打开文件
-void editor_open(char *filename) 
+//查任务中第pos个位置的块：在上一级同一块的结果(未查过则是整块)里筛选
+//更近的块已找到匹配时中途放弃，块保持未查，返回0
+//只读行树，不经过row_at，可在辅助线程中运行
+static int search_chunk_fill(struct search_pool *p, int pos, struct matcher *m)
 {
-    free(G.filename);
-    G.filename = strdup(filename);
-
-    select_highlight();
-
-    FILE *fp = fopen(filename, "r");
-    if (!fp)
+    int c = p->order[pos];
+    struct search_chunk *ch = &p->lv->chunks[c];
+    if (ch->done)
     {
-        warn("fopen");
-    } 
+        return 1;
+    }
+    int start = c * SEARCH_CHUNK_ROWS;
+    int end = (start + SEARCH_CHUNK_ROWS < G.numrows) ? start + SEARCH_CHUNK_ROWS : G.numrows;
+    struct search_chunk *bc = NULL;
+    if (p->base && p->base->chunks && p->base->chunks[c].done)
+    {
+        bc = &p->base->chunks[c];
+    }
+    int n = bc ? bc->n : end - start;
+
+    int *rows = NULL;
+    int cnt = 0;
+    int cap = 0;
+    int lstart = 0;
+    struct row_leaf *leaf = n ? row_leaf_find(bc ? bc->rows[0] : start, &lstart) : NULL;
+    for (int k = 0; k < n; k++)
+    {
+        if ((k & 255) == 255 && __atomic_load_n(&p->found, __ATOMIC_RELAXED) < pos)
+        {
+            free(rows);
+            return 0;
+        }
+        int i = bc ? bc->rows[k] : start + k;
+        while (i >= lstart + leaf->n)
+        {
+            lstart += leaf->n;
+            leaf = leaf->next;
+        }
+        if (row_find(&leaf->rows[i - lstart], m) < 0)
+        {
+            continue;
+        }
+        if (cnt == cap)
+        {
+            cap = cap ? cap * 2 : 64;
+            rows = realloc(rows, cap * sizeof(int));
+        }
+        rows[cnt++] = i;
+    }
+    ch->rows = rows;
+    ch->n = cnt;
+    ch->done = 1;
+    return 1;
+}
 
-    char *line = NULL;
-    size_t linecap = 0;
-    ssize_t linelen;
-    while ((linelen = getline(&line, &linecap, fp)) != -1) 
+//块内[lo, hi)范围里沿direction方向的第一个匹配行，没有返回-1
+static int search_pick(struct search_chunk *ch, int lo, int hi, int direction)
+{
+    //第一个不小于lo或hi的匹配行
+    int bound = (direction > 0) ? lo : hi;
+    int a = 0;
+    int b = ch->n;
+    while (a < b)
     {
-        while (linelen > 0 && (line[linelen - 1] == '\n' || line[linelen - 1] == '\r'))
+        int mid = (a + b) / 2;
+        if (ch->rows[mid] < bound)
+        {
+            a = mid + 1;
+        }
+        else
         {
-            linelen--;
+            b = mid;
         }
-        editor_insert_row(G.numrows, line, linelen);
     }
-    free(line);
-    fclose(fp);
-    G.dirty = 0;
+    if (direction > 0)
+    {
+        return (a < ch->n && ch->rows[a] < hi) ? ch->rows[a] : -1;
+    }
+    return (a > 0 && ch->rows[a - 1] >= lo) ? ch->rows[a - 1] : -1;
 }
 
-//将行内容转化为字符串
-char *rows_to_string(int *buflen) 
+//任务中第pos个位置的块在前方有没有匹配；第一块只看起点前方的部分
+static int search_ahead(struct search_pool *p, int pos)
 {
-    int totlen = 0;
-    int j;
-    for (j = 0; j < G.numrows; j++)
+    struct search_chunk *ch = &p->lv->chunks[p->order[pos]];
+    if (pos > 0)
     {
-        totlen += G.row[j].size + 1;
+        return ch->n > 0;
     }
-    *buflen = totlen;
+    return search_pick(ch, p->first_lo, p->first_hi, 1) >= 0;
+}
 
-    char *buf = malloc(totlen);
-    char *p = buf;
-    for (j = 0; j < G.numrows; j++) 
+//按顺序领块来查，直到查完或领到的块比已找到匹配的块更远
+static void search_run(struct search_pool *p, struct matcher *m)
+{
+    while (1)
     {
-        memcpy(p, G.row[j].chars, G.row[j].size);
-        p += G.row[j].size;
-        *p = '\n';
-        p++;
+        pthread_mutex_lock(&p->lock);
+        int pos = p->next;
+        int stop = (pos >= p->norder || pos > p->found);
+        if (!stop)
+        {
+            p->next++;
+        }
+        pthread_mutex_unlock(&p->lock);
+        if (stop)
+        {
+            return;
+        }
+        if (search_chunk_fill(p, pos, m) && search_ahead(p, pos))
+        {
+            pthread_mutex_lock(&p->lock);
+            if (pos < p->found)
+            {
+                __atomic_store_n(&p->found, pos, __ATOMIC_RELAXED);
+            }
+            pthread_mutex_unlock(&p->lock);
+        }
     }
-
-    return buf;
 }
 
-//保存内容到磁盘
-void save() 
+//查找辅助线程：等新任务，用自己的匹配器参与领块，DFA缓存在查找中会改写，不能与别的线程共用
+static void *search_thread(void *arg)
 {
-    if (G.filename == NULL) 
+    struct search_pool *p = G.search.pool;
+    int id = (long)arg;
+    pthread_mutex_lock(&p->lock);
+    while (1)
     {
-        G.filename = editor_prompt("Save as: %s (ESC to cancel)", NULL);
-        if (G.filename == NULL) 
+        while (p->job == p->seen[id])
         {
-            set_status_message("Save aborted");
-            return;
+            pthread_cond_wait(&p->start, &p->lock);
+        }
+        p->seen[id] = p->job;
+        if (id >= p->helpers)
+        {
+            continue;
+        }
+        pthread_mutex_unlock(&p->lock);
+        struct matcher *m = matcher_new(p->query, p->regex);
+        search_run(p, m);
+        matcher_free(m);
+        pthread_mutex_lock(&p->lock);
+        if (--p->active == 0)
+        {
+            pthread_cond_signal(&p->done);
         }
-        select_highlight();
     }
+    return NULL;
+}
 
-    int len;
-    char *buf = rows_to_string(&len);
+//本次查找能用的辅助线程数，不够时补建线程池
+static int search_helpers()
+{
+    struct search *sr = &G.search;
+    long want = sr->nthreads ? sr->nthreads : sysconf(_SC_NPROCESSORS_ONLN);
+    want = (want < 1) ? 0 : (want > SEARCH_THREADS_MAX) ? SEARCH_THREADS_MAX - 1 : want - 1;
 
-    int fd = open(G.filename, O_RDWR | O_CREAT, 0644);
-    if (fd != -1) 
+    struct search_pool *p = sr->pool;
+    if (p == NULL)
+    {
+        p = sr->pool = malloc(sizeof(struct search_pool));
+        p->nthreads = 0;
+        pthread_mutex_init(&p->lock, NULL);
+        pthread_cond_init(&p->start, NULL);
+        pthread_cond_init(&p->done, NULL);
+        p->job = 0;
+        p->helpers = 0;
+        p->active = 0;
+    }
+    while (p->nthreads < want)
     {
-        if (ftruncate(fd, len) != -1) 
+        //线程启动时可能已有新任务，从建线程时的任务编号算起
+        p->seen[p->nthreads] = p->job;
+        if (pthread_create(&p->threads[p->nthreads], NULL, search_thread, (void *)(long)p->nthreads) != 0)
         {
-            if (write(fd, buf, len) == len) 
-            {
-                close(fd);
-                free(buf);
-                G.dirty = 0;
-                set_status_message("%d bytes written to disk", len);
-                return;
-            }
+            break;
         }
-        close(fd);
+        pthread_detach(p->threads[p->nthreads]);
+        p->nthreads++;
     }
-    free(buf);
-    set_status_message("Can't save! I/O error: %s", strerror(errno));
+    return (p->nthreads < want) ? p->nthreads : want;
 }
 
-/*--------------------------编辑器操作------------------*/
-
-//编辑器调用editorRowInsertChar函数实现添加字符功能
-void editor_insert_char(int c) 
+//按order的顺序查lv的各块，查到前方有匹配的最近一块为止；更远的块有的查完了，有的被取消
+static void search_fill(struct search_level *lv, struct search_level *base, int *order, int n, int first_lo, int first_hi)
 {
-    if (G.cy == G.numrows) 
+    struct search *sr = &G.search;
+    int helpers = search_helpers();
+    struct search_pool *p = sr->pool;
+
+    pthread_mutex_lock(&p->lock);
+    p->lv = lv;
+    p->base = base;
+    p->order = order;
+    p->norder = n;
+    p->first_lo = first_lo;
+    p->first_hi = first_hi;
+    p->next = 0;
+    p->found = n;
+    //前面查过的块里已有匹配时不必叫醒辅助线程
+    while (p->next < n && lv->chunks[order[p->next]].done && !search_ahead(p, p->next))
     {
-        editor_insert_row(G.numrows, "", 0);
+        p->next++;
     }
-    row_insert_char(&G.row[G.cy], G.cx, c);
-    G.cx++;
+    if (p->next == n || lv->chunks[order[p->next]].done)
+    {
+        pthread_mutex_unlock(&p->lock);
+        return;
+    }
+    p->query = sr->query;
+    p->regex = sr->regex;
+    p->helpers = (n - p->next > 1) ? helpers : 0;
+    p->active = p->helpers;
+    if (p->helpers)
+    {
+        p->job++;
+        pthread_cond_broadcast(&p->start);
+    }
+    pthread_mutex_unlock(&p->lock);
+
+    search_run(p, sr->m);
+
+    pthread_mutex_lock(&p->lock);
+    while (p->active > 0)
+    {
+        pthread_cond_wait(&p->done, &p->lock);
+    }
+    pthread_mutex_unlock(&p->lock);
 }
 
-//编辑器实现退格
-void editor_del_char() 
+//从第from行往direction方向找下一个匹配的行，到头后绕回，找不到返回-1
+//从from所在的块起由近到远分块并行查找，找到最近的匹配就停下
+int search_next(const char *query, int from, int direction)
 {
-    if (G.cy == G.numrows)
+    struct search *sr = &G.search;
+    struct search_level *lv = search_level_for(query);
+    if (G.numrows == 0)
     {
-        return;
+        return -1;
     }
-    if (G.cx == 0 && G.cy == 0)
+    if (lv->chunks == NULL)
     {
-        return;
+        int next = from + direction;
+        return (next < 0) ? G.numrows - 1 : (next >= G.numrows) ? 0 : next;
     }
-    erow *row = &G.row[G.cy];
-    if (G.cx > 0) 
+
+    int n = lv->nchunks;
+    int c0 = (from < 0) ? 0 : from / SEARCH_CHUNK_ROWS;
+    int *order = malloc(n * sizeof(int));
+    for (int k = 0; k < n; k++)
     {
-        row_del_char(row, G.cx - 1);
-        G.cx--;
-    } 
-    else 
+        order[k] = ((c0 + direction * k) % n + n) % n;
+    }
+    //from所在的块分两半：前方的一半最先查，身后的一半绕回后最后查
+    int start = c0 * SEARCH_CHUNK_ROWS;
+    int end = (start + SEARCH_CHUNK_ROWS < G.numrows) ? start + SEARCH_CHUNK_ROWS : G.numrows;
+    int lo = (direction > 0) ? from + 1 : start;
+    int hi = (direction > 0) ? end : from;
+    search_fill(lv, (lv > sr->levels) ? lv - 1 : NULL, order, n, lo, hi);
+
+    int found = -1;
+    for (int k = 0; k < n && found < 0; k++)
     {
-        G.cx = G.row[G.cy - 1].size;
-        row_append_string(&G.row[G.cy - 1], row->chars, row->size);
-        editor_del_row(G.cy);
-        G.cy--;
+        int c = order[k];
+        if (k == 0)
+        {
+            found = search_pick(&lv->chunks[c], lo, hi, direction);
+        }
+        else
+        {
+            found = search_pick(&lv->chunks[c], c * SEARCH_CHUNK_ROWS, (c + 1) * SEARCH_CHUNK_ROWS, direction);
+        }
+    }
+    if (found < 0)
+    {
+        found = (direction > 0) ? search_pick(&lv->chunks[c0], start, from + 1, direction)
+                                : search_pick(&lv->chunks[c0], from, end, direction);
     }
+    free(order);
+    return found;
 }
 
-/*-----------------------搜索---------------------------*/
-
 //搜索匹配字符并高亮
 void find_call_back(char *query, int key) 
 {
     static int last_match = -1;
     static int direction = 1;
 
-    static int saved_hl_line;
-    static char *saved_hl = NULL;
-
-    if (saved_hl) 
-    {
-        memcpy(G.row[saved_hl_line].hl, saved_hl, G.row[saved_hl_line].rsize);
-        free(saved_hl);
-        saved_hl = NULL;
-    }
-
     if (key == '\r' || key == '\x1b') 
     {
         last_match = -1;
         direction = 1;
+        match_set_query(NULL, 0);
         return;
     } 
     else if (key == ARROW_RIGHT || key == ARROW_DOWN)
@@ -1099,6 +5502,14 @@ void find_call_back(char *query, int key)
     {
         direction = -1;
     } 
+    else if (key == CTRL_KEY('t'))
+    {
+        //切换字面查找与正则表达式查找，缓存的结果都作废
+        G.search.regex = !G.search.regex;
+        search_reset();
+        last_match = -1;
+        direction = 1;
+    }
     else 
     {
         last_match = -1;
@@ -1106,34 +5517,17 @@ void find_call_back(char *query, int key)
     }
 
     if (last_match == -1) direction = 1;
-    int current = last_match;
-    int i;
-    for (i = 0; i < G.numrows; i++) 
+    //在字符而不是render中查找，未显示过的映射行无需生成render
+    int current = search_next(query, last_match, direction);
+    //可见的匹配在draw_rows中统一高亮，总数由后台线程统计
+    match_set_query(query, G.search.regex);
+    G.match.row = current;
+    if (current != -1) 
     {
-        current += direction;
-        if (current == -1)
-        {
-            current = G.numrows - 1;
-        }
-        else if (current == G.numrows)
-        {
-            current = 0;
-        }
-        erow *row = &G.row[current];
-        char *match = strstr(row->render, query);
-        if (match) 
-        {
-            last_match = current;
-            G.cy = current;
-            G.cx = rx_to_cx(row, match - row->render);
-            G.rowoff = G.numrows;
-
-            saved_hl_line = current;
-            saved_hl = malloc(row->rsize);
-            memcpy(saved_hl, row->hl, row->rsize);
-            memset(&row->hl[match - row->render], HL_MATCH, strlen(query));
-            break;
-        }
+        last_match = current;
+        G.cy = current;
+        G.cx = row_find(row_at(current), G.search.m);
+        G.rowoff = G.numrows;
     }
 }
 
@@ -1142,12 +5536,12 @@ void find_call_back(char *query, int key)
 void find() 
 {
     //取消搜索时回复光标位置
-    int saved_cx = G.cx;
+    long saved_cx = G.cx;
     int saved_cy = G.cy;
-    int saved_coloff = G.coloff;
+    long saved_coloff = G.coloff;
     int saved_rowoff = G.rowoff;
 
-    char *query = editor_prompt("Search: %s (Use ESC/Arrows/Enter)",
+    char *query = editor_prompt("Search: %s (Use ESC/Arrows/Enter, Ctrl-T regex)",
                                 find_call_back);
 
     if (query) 
@@ -1168,41 +5562,23 @@ void find()
 char *C_HL_extensions[] = { ".c", ".h", ".cpp", NULL };
 char *Py_HL_extensions[] = {".py", NULL };
 
-//语法高亮关键词
-
-char *C_HL_keywords[] = 
-{
-    "switch", "if", "while", "for", "break", "continue", "return", "else",
-    "struct", "union", "typedef", "static", "enum", "or", "case",
-
-    "int|", "long|", "double|", "float|", "char|", "unsigned|", "signed|",
-    "void|",  NULL
-};
-
-char *Py_HL_keywords[] = 
-{
-    "if", "while", "for", "break", "continue", "return", "else", "or", 
-    "as", "assert", "not", "del", "elif", "except", "False", "finally",
-    "from", "global", "import", "in", "is", "lambda", "None", "nonlocal",
-    "pass", "raise", "try", "with", "yield", "True","and",
-
-
-    "def|", "class|", NULL
-};
+//语法高亮关键词，表由kwgen在编译时生成
+#include "keywords.h"
+#include "kwhash.h"
 
 struct editor_syntax HLDB[] = 
 {
     {
         "c",
         C_HL_extensions,
-        C_HL_keywords,
+        &C_HL_kw,
         "//", "/*", "*/",
         HL_HIGHLIGHT_NUMBERS | HL_HIGHLIGHT_STRINGS
     },
     {
         "py",
         Py_HL_extensions,
-        Py_HL_keywords,
+        &Py_HL_kw,
         "//", "/*", "*/",
         HL_HIGHLIGHT_NUMBERS | HL_HIGHLIGHT_STRINGS
     },
@@ -1213,22 +5589,83 @@ struct editor_syntax HLDB[] =
 //判断是否是分隔符
 int is_separator(int c) 
 {
-    return isspace(c) || c == '\0' || strchr(",.()+-/*=~%<>[];", c) != NULL;
+    return separator_table[(unsigned char)c];
+}
+
+//查找从s开始、到下一个分隔符为止的单词是否是关键词，返回关键词类型并把长度写入*klen，不是返回0
+static int keyword_lookup(const struct keyword_table *kt, const char *s, long len, int *klen)
+{
+    int n = 0;
+    while (n < len && n <= kt->maxlen && !separator_table[(unsigned char)s[n]])
+    {
+        n++;
+    }
+    if (n < kt->minlen || n > kt->maxlen)
+    {
+        return 0;
+    }
+    const struct keyword *k = &kt->slots[keyword_hash(s, n, kt->seed) & kt->mask];
+    if (k->word == NULL || k->len != n || memcmp(s, k->word, n) != 0)
+    {
+        return 0;
+    }
+    *klen = n;
+    return k->type;
 }
 
 
 
-void update_syntax(erow *row) 
+//追加一段高亮，超过一段的最大长度时拆开
+static void hl_append(struct hl_out *out, long len, int type)
 {
-    row->hl = realloc(row->hl, row->rsize);
-    memset(row->hl, HL_NORMAL, row->rsize);
+    while (len > 0)
+    {
+        if (out->n == out->cap)
+        {
+            out->cap = out->cap ? out->cap * 2 : 64;
+            out->spans = realloc(out->spans, out->cap * sizeof(struct hl_span));
+        }
+        long n = (len < HL_SPAN_MAX) ? len : HL_SPAN_MAX;
+        out->spans[out->n].len = n;
+        out->spans[out->n].type = type;
+        out->n++;
+        len -= n;
+    }
+}
 
-    if (G.syntax == NULL)
+//把[at, at+len)标成type：at之前还没输出的部分补一段HL_NORMAL，与上一段同类时直接加长
+static void hl_put(struct hl_out *out, long at, long len, int type)
+{
+    if (out == NULL)
     {
         return;
     }
+    if (at > out->end)
+    {
+        hl_append(out, at - out->end, HL_NORMAL);
+    }
+    struct hl_span *last = out->n ? &out->spans[out->n - 1] : NULL;
+    if (last && at == out->end && last->type == type && last->len + len <= HL_SPAN_MAX)
+    {
+        last->len += len;
+    }
+    else
+    {
+        hl_append(out, len, type);
+    }
+    out->end = at + len;
+}
+
+//对一行文本做语法分析，in_comment是行首是否处于多行注释中，返回行尾的注释状态
+//高亮段追加到out，最后一段之后都是HL_NORMAL；out为NULL时只算注释状态
+int syntax_scan(const char *s, long len, int in_comment, struct hl_out *out) 
+{
+    if (G.syntax == NULL)
+    {
+        return 0;
+    }
 
-    char **keywords = G.syntax->keywords;
+    const struct keyword_table *keywords = G.syntax->keywords;
 
     char *scs = G.syntax->singleline_comment_start;
     char *mcs = G.syntax->multiline_comment_start;
@@ -1239,20 +5676,19 @@ void update_syntax(erow *row)
     int mce_len = mce ? strlen(mce) : 0;
 
     int prev_sep = 1;
+    int prev_hl = HL_NORMAL;  //上一个字节的高亮类型
     int in_string = 0;
-    int in_comment = (row->idx > 0 && G.row[row->idx - 1].hl_open_comment);
 
-    int i = 0;
-    while (i < row->rsize) 
+    long i = 0;
+    while (i < len) 
     {
-        char c = row->render[i];
-        unsigned char prev_hl = (i > 0) ? row->hl[i - 1] : HL_NORMAL;
+        char c = s[i];
 
         if (scs_len && !in_string && !in_comment) 
         {
-            if (!strncmp(&row->render[i], scs, scs_len)) 
+            if (i + scs_len <= len && !memcmp(&s[i], scs, scs_len)) 
             {
-                memset(&row->hl[i], HL_COMMENT, row->rsize - i);
+                hl_put(out, i, len - i, HL_COMMENT);
                 break;
             }
         }
@@ -1261,10 +5697,10 @@ void update_syntax(erow *row)
         {
             if (in_comment) 
             {
-                row->hl[i] = HL_MLCOMMENT;
-                if (!strncmp(&row->render[i], mce, mce_len)) 
+                prev_hl = HL_MLCOMMENT;
+                if (i + mce_len <= len && !memcmp(&s[i], mce, mce_len)) 
                 {
-                    memset(&row->hl[i], HL_MLCOMMENT, mce_len);
+                    hl_put(out, i, mce_len, HL_MLCOMMENT);
                     i += mce_len;
                     in_comment = 0;
                     prev_sep = 1;
@@ -1272,13 +5708,15 @@ void update_syntax(erow *row)
                 } 
                 else 
                 {
+                    hl_put(out, i, 1, HL_MLCOMMENT);
                     i++;
                     continue;
                 }
             } 
-            else if (!strncmp(&row->render[i], mcs, mcs_len)) 
+            else if (i + mcs_len <= len && !memcmp(&s[i], mcs, mcs_len)) 
             {
-                memset(&row->hl[i], HL_MLCOMMENT, mcs_len);
+                hl_put(out, i, mcs_len, HL_MLCOMMENT);
+                prev_hl = HL_MLCOMMENT;
                 i += mcs_len;
                 in_comment = 1;
                 continue;
@@ -1289,13 +5727,14 @@ void update_syntax(erow *row)
         {
             if (in_string) 
             {
-                row->hl[i] = HL_STRING;
-                if (c == '\\' && i + 1 < row->rsize) 
+                prev_hl = HL_STRING;
+                if (c == '\\' && i + 1 < len) 
                 {
-                    row->hl[i + 1] = HL_STRING;
+                    hl_put(out, i, 2, HL_STRING);
                     i += 2;
                     continue;
                 }
+                hl_put(out, i, 1, HL_STRING);
                 if (c == in_string)
                 {
                     in_string = 0;
@@ -1309,7 +5748,8 @@ void update_syntax(erow *row)
                 if (c == '"' || c == '\'') 
                 {
                     in_string = c;
-                    row->hl[i] = HL_STRING;
+                    hl_put(out, i, 1, HL_STRING);
+                    prev_hl = HL_STRING;
                     i++;
                     continue;
                 }
@@ -1321,7 +5761,8 @@ void update_syntax(erow *row)
             if ((isdigit(c) && (prev_sep || prev_hl == HL_NUMBER)) ||
                 (c == '.' && prev_hl == HL_NUMBER)) 
             {
-                row->hl[i] = HL_NUMBER;
+                hl_put(out, i, 1, HL_NUMBER);
+                prev_hl = HL_NUMBER;
                 i++;
                 prev_sep = 0;
                 continue;
@@ -1330,44 +5771,152 @@ void update_syntax(erow *row)
 
         if (prev_sep) 
         {
-            int j;
-            for (j = 0; keywords[j]; j++) 
-            {
-                int klen = strlen(keywords[j]);
-                int kw2 = keywords[j][klen - 1] == '|';
-                if (kw2)
-                {
-                    klen--;
-                }
-
-                if (!strncmp(&row->render[i], keywords[j], klen) &&
-                    is_separator(row->render[i + klen])) 
-                {
-                    memset(&row->hl[i], kw2 ? HL_KEYWORD2 : HL_KEYWORD1, klen);
-                    i += klen;
-                    break;
-                }
-            }
-            if (keywords[j] != NULL) 
+            int klen;
+            int type = keyword_lookup(keywords, &s[i], len - i, &klen);
+            if (type) 
             {
+                hl_put(out, i, klen, type);
+                prev_hl = type;
+                i += klen;
                 prev_sep = 0;
                 continue;
             }
         }
 
+        prev_hl = HL_NORMAL;
         prev_sep = is_separator(c);
         i++;
     }
 
-    int changed = (row->hl_open_comment != in_comment);
-    row->hl_open_comment = in_comment;
-    if (changed && row->idx + 1 < G.numrows)
+    return in_comment;
+}
+
+//只计算一行行尾的注释状态，直接分析chars，不需要生成render
+int syntax_state(erow *row, int entry)
+{
+    return syntax_scan(row->chars, row->size, entry, NULL);
+}
+
+//记下边界上第i行算出的行尾注释状态，边界后移一行，stop表示不再往下推进
+//重新算出的状态与缓存相同且没有待重算的行时，后面的缓存全部可信，边界直接移到末尾
+static void hl_commit(int i, int out, int stop)
+{
+    erow *row = row_at(i);
+    if (row->state_epoch != G.hl_epoch)
+    {
+        row->state_epoch = G.hl_epoch;
+        G.hl_dirty_rows--;
+    }
+    int same = (out == row->hl_open_comment);
+    row->hl_open_comment = out;
+    G.hl_frontier = i + 1;
+
+    if (same && G.hl_dirty_rows == 0)
+    {
+        G.hl_frontier = G.numrows;
+    }
+    else if (!same && stop)
+    {
+        //停在这里时下一行的入口状态已变，它的缓存不再可信
+        hl_invalidate(i + 1);
+    }
+}
+
+//顺序推进注释状态缓存，直到第target行的状态可信
+//budget不为NULL时最多分析*budget字节，用完返回0，留给下次继续
+int hl_advance_budget(int target, long *budget)
+{
+    while (G.hl_frontier <= target && G.hl_frontier < G.numrows)
+    {
+        if (budget != NULL && *budget <= 0)
+        {
+            return 0;
+        }
+        int i = G.hl_frontier;
+        int entry = (i > 0) ? row_at(i - 1)->hl_open_comment : 0;
+        erow *row = row_at(i);
+        if (budget != NULL)
+        {
+            *budget -= row->size + 1;
+        }
+        hl_commit(i, syntax_state(row, entry), i == target);
+    }
+    return 1;
+}
+
+void hl_advance(int target)
+{
+    hl_advance_budget(target, NULL);
+}
+
+//第filerow行的内容或入口状态可能变了，它的注释状态需要重新计算
+void hl_invalidate(int filerow)
+{
+    if (filerow < G.hl_frontier)
+    {
+        G.hl_frontier = filerow;
+    }
+    if (filerow >= G.numrows)
+    {
+        return;
+    }
+    erow *row = row_at(filerow);
+    if (row->state_epoch == G.hl_epoch)
+    {
+        row->state_epoch = G.hl_epoch - 1;
+        G.hl_dirty_rows++;
+    }
+}
+
+//行首的注释状态，需要时先推进状态缓存
+int hl_entry_state(int filerow)
+{
+    if (filerow == 0)
+    {
+        return 0;
+    }
+    hl_advance(filerow - 1);
+    return row_at(filerow - 1)->hl_open_comment;
+}
+
+//第filerow行的高亮是否对应当前的内容、语法规则和行首注释状态，行首状态还不可信时算作过期
+int hl_fresh(int filerow)
+{
+    erow *row = row_at(filerow);
+    if (row->hl_gen != row->gen || row->hl_epoch != G.hl_epoch || filerow > G.hl_frontier)
+    {
+        return 0;
+    }
+    int entry = (filerow > 0) ? row_at(filerow - 1)->hl_open_comment : 0;
+    return row->hl_entry == entry;
+}
+
+//生成一行的高亮
+void update_syntax(int filerow) 
+{
+    erow *row = row_at(filerow);
+    int entry = hl_entry_state(filerow);
+
+    //高亮段先写进共用的缓冲区，算完再按实际段数放进slab
+    static struct hl_out spans;
+    spans.n = 0;
+    spans.end = 0;
+    int out = syntax_scan(row->render, row->rsize, entry, &spans);
+    row_set_spans(row, spans.spans, spans.n);
+    row->hl_entry = entry;
+    row->hl_gen = row->gen;
+    row->hl_epoch = G.hl_epoch;
+
+    //本行正好在状态缓存的边界上，顺便推进边界
+    if (filerow == G.hl_frontier)
     {
-        update_syntax(&G.row[row->idx + 1]);
+        hl_commit(filerow, out, 1);
     }
 }
 
 
+
+
 //根据不同关键词类型返回不同颜色
 int syntax_color(int hl) 
 {
@@ -1395,6 +5944,11 @@ int syntax_color(int hl)
 //根据文件类型判断是否该语法高亮
 void select_highlight() 
 {
+    //所有行的高亮和注释状态都作废，显示时按需重新计算
+    G.hl_epoch++;
+    G.hl_frontier = 0;
+    G.hl_dirty_rows = G.numrows;
+
     G.syntax = NULL;
     if (G.filename == NULL)
     {
@@ -1414,12 +5968,6 @@ void select_highlight()
                 (!is_ext && strstr(G.filename, s->filematch[i])))
             {
                 G.syntax = s;
-
-                int filerow;
-                for (filerow = 0; filerow < G.numrows; filerow++) 
-                {
-                update_syntax(&G.row[filerow]);
-                }
                 return;
             }
             i++;
@@ -1427,6 +5975,130 @@ void select_highlight()
     }
 }
 
+/*-----------------------后台线程-------------------------*/
+
+//界面线程取锁，先登记等待，让后台线程在分片边界上让出
+void editor_lock()
+{
+    __atomic_add_fetch(&G.ui_waiting, 1, __ATOMIC_ACQ_REL);
+    pthread_mutex_lock(&G.lock);
+    __atomic_sub_fetch(&G.ui_waiting, 1, __ATOMIC_ACQ_REL);
+}
+
+//界面线程放锁，唤醒后台线程看看有没有新的工作
+void editor_unlock()
+{
+    pthread_cond_signal(&G.work_cond);
+    pthread_mutex_unlock(&G.lock);
+}
+
+//后台补齐屏幕上过期的高亮，返回1表示都已补齐，返回0表示预算用完
+static int hl_work(long *budget)
+{
+    int done = 1;
+    int redraw = 0;
+    for (int y = 0; y < G.screenrows; y++)
+    {
+        int filerow = G.rowoff + y;
+        if (filerow >= G.numrows)
+        {
+            break;
+        }
+        //还没显示过的行由界面线程自己生成
+        if (row_at(filerow)->render == NULL || hl_fresh(filerow))
+        {
+            continue;
+        }
+        if (!hl_advance_budget(filerow - 1, budget))
+        {
+            done = 0;
+            break;
+        }
+        update_syntax(filerow);
+        *budget -= row_at(filerow)->rsize;
+        redraw = 1;
+    }
+    if (redraw)
+    {
+        request_redraw();
+    }
+    return done;
+}
+
+//后台统计一片匹配数，一次统计一整块；返回1表示统计完或不在搜索
+static int count_work(long *budget)
+{
+    struct match_count *m = &G.match;
+    if (m->query == NULL || m->query[0] == '\0')
+    {
+        return 1;
+    }
+    int progress = 0;
+    while (m->nblocks * COUNT_BLOCK < G.numrows && *budget > 0)
+    {
+        int start = m->nblocks * COUNT_BLOCK;
+        int end = (start + COUNT_BLOCK < G.numrows) ? start + COUNT_BLOCK : G.numrows;
+        long n = 0;
+        for (int i = start; i < end; i++)
+        {
+            erow *row = row_at(i);
+            n += row_count(row, m->m);
+            *budget -= row->size + 1;
+        }
+        if (m->nblocks == m->cap)
+        {
+            m->cap = m->cap ? m->cap * 2 : 64;
+            m->blocks = realloc(m->blocks, m->cap * sizeof(long));
+        }
+        m->blocks[m->nblocks++] = n;
+        m->total += n;
+        progress = 1;
+    }
+    if (progress)
+    {
+        request_redraw();
+    }
+    return m->nblocks * COUNT_BLOCK >= G.numrows;
+}
+
+//后台线程：持锁分片工作，依次补齐屏幕上的高亮、统计匹配数、推进整个文件的注释状态缓存
+//界面线程等锁时让出，没有工作时睡眠
+static void *worker(void *arg)
+{
+    (void)arg;
+    pthread_mutex_lock(&G.lock);
+    while (1)
+    {
+        long budget = WORK_SLICE_BYTES;
+        int idle = hl_work(&budget);
+        if (idle)
+        {
+            idle = count_work(&budget);
+        }
+        if (idle)
+        {
+            idle = hl_advance_budget(G.numrows - 1, &budget);
+        }
+        if (idle || __atomic_load_n(&G.ui_waiting, __ATOMIC_ACQUIRE))
+        {
+            pthread_cond_wait(&G.work_cond, &G.lock);
+        }
+    }
+    return NULL;
+}
+
+//启动后台线程，之后远处的高亮和匹配计数不再阻塞界面
+void worker_start()
+{
+    pthread_t tid;
+    if (pthread_create(&tid, NULL, worker, NULL) != 0)
+    {
+        return;
+    }
+    pthread_detach(tid);
+    G.threaded = 1;
+}
+
 /*-----------------------初始化-------------------------*/
 
 void init() 
@@ -1437,12 +6109,81 @@ void init()
     G.rowoff = 0;
     G.coloff = 0;
     G.numrows = 0;
-    G.row = NULL;
+    G.rows.root = NULL;
+    G.rows.hint = NULL;
     G.dirty = 0;
     G.filename = NULL;
+    G.map = NULL;
+    G.map_len = 0;
     G.statusmsg[0] = '\0';
     G.statusmsg_time = 0;
     G.syntax = NULL;
+    G.hl_epoch = 1;
+    G.hl_frontier = 0;
+    G.hl_dirty_rows = 0;
+    G.gen = 0;
+    pthread_mutex_init(&G.lock, NULL);
+    pthread_cond_init(&G.work_cond, NULL);
+    G.threaded = 0;
+    G.ui_waiting = 0;
+    G.redraw = 0;
+    G.wake[0] = G.wake[1] = -1;
+    G.winch = 0;
+    G.input.head = G.input.tail = 0;
+    G.scr.rows = G.scr.cols = 0;
+    G.scr.front_ch = G.scr.back_ch = NULL;
+    G.scr.front_attr = G.scr.back_attr = NULL;
+    G.frame.b = NULL;
+    G.frame.len = G.frame.cap = G.frame.allocs = 0;
+    G.search.query = NULL;
+    G.search.levels = NULL;
+    G.search.nlevels = G.search.cap = 0;
+    G.search.m = NULL;
+    G.search.regex = 0;
+    G.search.nthreads = 0;
+    G.search.pool = NULL;
+    G.match.query = NULL;
+    G.match.m = NULL;
+    G.match.regex = 0;
+    G.match.row = -1;
+    G.match.blocks = NULL;
+    G.match.nblocks = G.match.cap = 0;
+    G.match.total = 0;
+    G.undo.buf = NULL;
+    G.undo.cap = 0;
+    G.undo.limit = UNDO_LIMIT;
+    G.undo.group = 0;
+    G.undo.sealed = 0;
+    G.undo.replaying = 0;
+    G.undo.overflow = 0;
+    undo_clear();
+    G.rcache.bytes = 0;
+    G.rcache.limit = RENDER_CACHE_LIMIT;
+    G.rcache.clock = 0;
+    G.rcache.leaves = NULL;
+    G.rcache.n = G.rcache.cap = 0;
+    G.swap.path = NULL;
+    G.swap.fd = -1;
+    G.swap.buf = NULL;
+    G.swap.len = G.swap.cap = 0;
+    G.swap.last = -1;
+    G.swap.head = 1;
+    G.swap.started = 0;
+    G.swap.replaying = 0;
+    G.swap.failed = 0;
+    pthread_mutex_init(&G.swap.lock, NULL);
+    pthread_mutex_init(&G.swap.io, NULL);
+    pthread_cond_init(&G.swap.cond, NULL);
+    G.job.pid = 0;
+    G.job.fd = -1;
+    G.job.name = NULL;
+    G.job.out = NULL;
+    G.job.len = G.job.cap = 0;
+    G.job.lines = NULL;
+    G.job.nlines = G.job.lines_cap = 0;
+    G.job.visible = 0;
+    G.job.rows = 0;
+    G.job.scroll = 0;
 
     if (window_size(&G.screenrows, &G.screencols) == -1)
     {
@@ -1456,17 +6197,25 @@ int main(int argc, char *argv[])
 {
     enable_raw_mode();
     init();
+    events_init();
+    editor_lock();
+    //打开文件时恢复交换文件的提示会替换掉帮助
+    set_status_message("HELP: Ctrl-S = save | Ctrl-Q = quit | Ctrl-F = find | Ctrl-O = output");
     if (argc >= 2) 
     {
         editor_open(argv[1]);
     }
-
-    set_status_message("HELP: Ctrl-S = save | Ctrl-Q = quit | Ctrl-F = find");
+    worker_start();
+    swap_start();
 
     while (1) 
     {
         refresh_screen();
-        process_key();
+        //已到达的按键全部处理完再重画，按住不放或粘贴时只出一帧
+        do
+        {
+            process_key();
+        } while (key_pending());
     }
 
     return 0;
@@ -0,0 +1,43 @@
+/*** 语法高亮关键词表，由cv.c和生成工具kwgen共同引用 ***/
+
+#ifndef KEYWORDS_H
+#define KEYWORDS_H
+
+//除空白和'\0'以外的分隔符
+#define SEPARATORS ",.()+-/*=~%<>[];"
+
+//关键词末尾带'|'的是第二类关键词(类型名)
+
+char *C_HL_keywords[] = 
+{
+    "switch", "if", "while", "for", "break", "continue", "return", "else",
+    "struct", "union", "typedef", "static", "enum", "or", "case",
+
+    "int|", "long|", "double|", "float|", "char|", "unsigned|", "signed|",
+    "void|",  NULL
+};
+
+char *Py_HL_keywords[] = 
+{
+    "if", "while", "for", "break", "continue", "return", "else", "or", 
+    "as", "assert", "not", "del", "elif", "except", "False", "finally",
+    "from", "global", "import", "in", "is", "lambda", "None", "nonlocal",
+    "pass", "raise", "try", "with", "yield", "True","and",
+
+
+    "def|", "class|", NULL
+};
+
+//关键词散列：带种子的FNV-1a，生成工具挑选使表内无冲突的种子
+static unsigned int keyword_hash(const char *s, int len, unsigned int seed)
+{
+    unsigned int h = 2166136261u ^ seed;
+    for (int i = 0; i < len; i++)
+    {
+        h ^= (unsigned char)s[i];
+        h *= 16777619u;
+    }
+    return h ^ (h >> 15);
+}
+
+#endif
@@ -0,0 +1,114 @@
+/*** 关键词表生成工具：为每种语言的关键词找一个完美散列，输出kwhash.h ***/
+
+#include <ctype.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "keywords.h"
+
+#define MAX_SEEDS 100000                 //每种表长最多尝试的种子数
+
+//找出使所有关键词落在不同槽位的表长和种子，输出一张语言的散列表
+static void emit_table(const char *name, char **keywords)
+{
+    int n = 0;
+    int minlen = 1 << 30;
+    int maxlen = 0;
+    while (keywords[n])
+    {
+        int len = strlen(keywords[n]);
+        if (keywords[n][len - 1] == '|')
+        {
+            len--;
+        }
+        if (len < minlen)
+        {
+            minlen = len;
+        }
+        if (len > maxlen)
+        {
+            maxlen = len;
+        }
+        n++;
+    }
+
+    int size = 1;
+    while (size < 2 * n)
+    {
+        size <<= 1;
+    }
+
+    int *slot = NULL;
+    unsigned int seed = 0;
+    while (1)
+    {
+        slot = realloc(slot, size * sizeof(int));
+        for (seed = 0; seed < MAX_SEEDS; seed++)
+        {
+            int ok = 1;
+            memset(slot, -1, size * sizeof(int));
+            for (int j = 0; j < n && ok; j++)
+            {
+                int len = strlen(keywords[j]);
+                if (keywords[j][len - 1] == '|')
+                {
+                    len--;
+                }
+                int h = keyword_hash(keywords[j], len, seed) & (size - 1);
+                if (slot[h] != -1)
+                {
+                    ok = 0;
+                }
+                slot[h] = j;
+            }
+            if (ok)
+            {
+                break;
+            }
+        }
+        if (seed < MAX_SEEDS)
+        {
+            break;
+        }
+        size <<= 1;
+    }
+
+    printf("static const struct keyword %s_slots[%d] = \n{\n", name, size);
+    for (int h = 0; h < size; h++)
+    {
+        if (slot[h] == -1)
+        {
+            continue;
+        }
+        const char *kw = keywords[slot[h]];
+        int len = strlen(kw);
+        int kw2 = kw[len - 1] == '|';
+        if (kw2)
+        {
+            len--;
+        }
+        printf("    [%d] = {\"%.*s\", %d, %s},\n", h, len, kw, len, kw2 ? "HL_KEYWORD2" : "HL_KEYWORD1");
+    }
+    printf("};\n\n");
+    printf("static const struct keyword_table %s = { %s_slots, %d, %uu, %d, %d };\n\n",
+           name, name, size - 1, seed, minlen, maxlen);
+    free(slot);
+}
+
+int main()
+{
+    printf("/*** 由kwgen根据keywords.h生成，不要手工修改 ***/\n\n");
+
+    printf("static const unsigned char separator_table[256] = \n{\n");
+    for (int c = 0; c < 256; c++)
+    {
+        int sep = (c == '\0' || isspace(c) || strchr(SEPARATORS, c) != NULL);
+        printf("%s%d,%s", (c % 16 == 0) ? "    " : "", sep, (c % 16 == 15) ? "\n" : " ");
+    }
+    printf("};\n\n");
+
+    emit_table("C_HL_kw", C_HL_keywords);
+    emit_table("Py_HL_kw", Py_HL_keywords);
+    return 0;
+}